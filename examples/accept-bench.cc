@@ -0,0 +1,56 @@
+#include <handy/handy.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+using namespace std;
+using namespace handy;
+
+// usage: accept-bench [single|perloop] [loops] [client threads] [seconds]
+// 客户端线程不断建立连接，服务端接受后立即关闭连接，统计服务端每秒接受的连接数
+// single: 一个监听socket，接受后通过safeCall转交给其他线程；perloop: 每个事件派发器各自监听并接受
+int main(int argc, const char *argv[]) {
+    bool perLoop = argc > 1 && string(argv[1]) == "perloop";
+    int loops = argc > 2 ? atoi(argv[2]) : 4;
+    int clients = argc > 3 ? atoi(argv[3]) : 4;
+    int seconds = argc > 4 ? atoi(argv[4]) : 3;
+    setloglevel("WARN");
+
+    MultiBase bases(loops);
+    TcpServerPtr svr = TcpServer::startServer(&bases, "127.0.0.1", 2099, false, perLoop);
+    exitif(svr == NULL, "start tcp server failed");
+    atomic<long> accepted(0);
+    svr->onConnState([&](const TcpConnPtr &con) {
+        if (con->getState() == TcpConn::Connected) {
+            accepted++;
+            con->close();
+        }
+    });
+    thread th([&] { bases.loop(); });
+
+    atomic<bool> stop(false);
+    vector<thread> ths;
+    Ip4Addr addr("127.0.0.1", 2099);
+    for (int i = 0; i < clients; i++) {
+        ths.push_back(thread([&] {
+            while (!stop) {
+                int fd = socket(AF_INET, SOCK_STREAM, 0);
+                if (connect(fd, (struct sockaddr *) &addr.getAddr(), sizeof(struct sockaddr)) == 0) {
+                    // wait for the close of the server, so TIME_WAIT stays on the server side
+                    char buf[16];
+                    while (read(fd, buf, sizeof buf) > 0) {
+                    }
+                }
+                close(fd);
+            }
+        }));
+    }
+    sleep(seconds);
+    stop = true;
+    for (auto &t : ths) {
+        t.join();
+    }
+    printf("%s loops %d clients %d: %.0f accepts/s\n", perLoop ? "perloop" : "single", loops, clients, accepted * 1.0 / seconds);
+    bases.exit();
+    th.join();
+    return 0;
+}
@@ -37,11 +37,13 @@ int main(int argc, const char *argv[]) {
             string resp = util::format("%ld# %.*s", cid, msg.end() - p, p);
 
             int sended = 0;
-            if (id == 0) {  //发给其他所有用户
+            if (id == 0) {  //发给其他所有用户，只编码一次，所有连接共享同一份数据
+                ChainBuffer out;
+                out.appendMsg(con->codec_.get(), resp);
                 for (auto &pc : users) {
                     if (pc.first != cid) {
                         sended++;
-                        pc.second->sendMsg(resp);
+                        pc.second->send(out);
                     }
                 }
             } else {  //发给特定用户
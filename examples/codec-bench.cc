@@ -0,0 +1,105 @@
+#include <handy/handy.h>
+
+using namespace std;
+using namespace handy;
+
+// usage: codec-bench [rounds]
+// 测量解码的速度：大量短行一次解析完，以及1M的长行分成多个tcp分段到达时每个分段都尝试解析一次
+// 另外对比短消息经过CodecBase虚函数与直接使用FrameCodec时的解码速度，以及CrcLengthCodec校验的开销
+
+template <class C>
+double decodeAll(C &codec, Slice all, int rounds, long &msgs) {
+    int64_t start = util::steadyMicro();
+    for (int r = 0; r < rounds; r++) {
+        Slice data(all), msg;
+        int n;
+        while ((n = codec.tryDecode(data, msg)) > 0) {
+            data.eat(n);
+            msgs++;
+        }
+    }
+    return (util::steadyMicro() - start) / 1000000.0;
+}
+
+int main(int argc, const char *argv[]) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 10;
+
+    string lines;
+    while (lines.size() < 64 * 1024 * 1024) {
+        lines.append(30, 'a').append("\r\n");
+    }
+    int64_t start = util::steadyMicro();
+    long msgs = 0;
+    for (int r = 0; r < rounds; r++) {
+        LineCodec codec;
+        Slice data(lines), msg;
+        int n;
+        while ((n = codec.tryDecode(data, msg)) > 0) {
+            data.eat(n);
+            msgs++;
+        }
+    }
+    double used = (util::steadyMicro() - start) / 1000000.0;
+    printf("LineCodec 32 byte lines: %.1f M msgs/s %.0f MB/s\n", msgs / used / 1000000, lines.size() * rounds / used / 1024 / 1024);
+
+    string line(1024 * 1024, 'a');
+    line += "\n";
+    const size_t kSegment = 1448;
+    start = util::steadyMicro();
+    for (int r = 0; r < rounds; r++) {
+        LineCodec codec(2 * 1024 * 1024);
+        Slice msg;
+        for (size_t len = kSegment;; len += kSegment) {
+            len = min(len, line.size());
+            if (codec.tryDecode(Slice(line.data(), len), msg) > 0) {
+                break;
+            }
+        }
+    }
+    used = (util::steadyMicro() - start) / 1000000.0;
+    printf("LineCodec 1M line in %lu byte segments: %.2f ms/line\n", kSegment, used * 1000 / rounds);
+
+    Buffer frames;
+    LengthCodec length;
+    while (frames.size() < 64 * 1024 * 1024) {
+        length.encode(Slice(lines.data(), 24), frames);
+    }
+    // cloned through the base, the compiler cannot resolve the calls statically
+    unique_ptr<CodecBase> virt(static_cast<CodecBase &>(length).clone());
+    msgs = 0;
+    used = decodeAll(*virt, frames, rounds, msgs);
+    printf("LengthCodec via CodecBase 24 byte msgs: %.1f M msgs/s\n", msgs / used / 1000000);
+    FrameCodec<FixedLen<4>, Magic<'m', 'B', 'd', 'T'>> fixed;
+    msgs = 0;
+    used = decodeAll(fixed, frames, rounds, msgs);
+    printf("FrameCodec with the same format: %.1f M msgs/s\n", msgs / used / 1000000);
+
+    string payload(16 * 1024, 'a');
+    for (size_t i = 0; i < payload.size(); i++) {
+        payload[i] = char(i * 131);
+    }
+    unique_ptr<CodecBase> plain(new LengthCodec), crc(new CrcLengthCodec);
+    Buffer plainFrames, crcFrames;
+    while (plainFrames.size() < 64 * 1024 * 1024) {
+        plain->encode(payload, plainFrames);
+        crc->encode(payload, crcFrames);
+    }
+    msgs = 0;
+    double plainUsed = decodeAll(*plain, plainFrames, rounds, msgs);
+    msgs = 0;
+    double crcUsed = decodeAll(*crc, crcFrames, rounds, msgs);
+    double bytes = double(plainFrames.size()) * rounds;
+    printf("16K msgs: LengthCodec %.0f MB/s, CrcLengthCodec %.0f MB/s\n", bytes / plainUsed / 1024 / 1024, bytes / crcUsed / 1024 / 1024);
+    // the cpu time checksumming costs at 10Gbps, relative to one core
+    printf("CrcLengthCodec extra cpu at 10Gbps: %.1f%% of a core\n", (crcUsed - plainUsed) / bytes * 1.25e9 * 100);
+    for (int portable = 0; portable < 2; portable++) {
+        start = util::steadyMicro();
+        uint32_t sum = 0;
+        for (int r = 0; r < rounds; r++) {
+            sum = portable ? crc32cPortable(sum, crcFrames.data(), crcFrames.size()) : crc32c(sum, crcFrames.data(), crcFrames.size());
+        }
+        used = (util::steadyMicro() - start) / 1000000.0;
+        printf("%s: %.0f MB/s (%08x)\n", portable ? "crc32cPortable" : "crc32c", crcFrames.size() * rounds / used / 1024 / 1024, sum);
+    }
+    return 0;
+}
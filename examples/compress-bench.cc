@@ -0,0 +1,69 @@
+#include <handy/handy.h>
+#include <handy/zlib_codec.h>
+
+using namespace std;
+using namespace handy;
+
+// usage: compress-bench [msgs]
+// 一端编码一端解码，模拟一个连接上的json消息，统计ZlibCodec节省的字节数与编码、解码消耗的cpu
+#ifdef HANDY_ZLIB
+
+string makeMsg(int i) {
+    return util::format(
+        "{\"id\":%d,\"user\":\"user%05d\",\"type\":\"order\",\"status\":\"%s\",\"price\":%d.%02d,\"quantity\":%d,"
+        "\"items\":[{\"sku\":\"SKU-%06d\",\"name\":\"product %d\",\"tags\":[\"fast\",\"cheap\"]},{\"sku\":\"SKU-%06d\",\"name\":\"product %d\"}],"
+        "\"address\":{\"city\":\"city %d\",\"street\":\"%d main street\",\"zip\":\"%05d\"},\"note\":\"deliver in the morning, call before arrival\","
+        "\"created\":\"2024-05-%02d 12:%02d:%02d\"}",
+        i, i % 977, i % 3 ? "paid" : "shipped", i % 1000, i % 100, i % 7 + 1, i * 7 % 1000003, i % 13, i * 11 % 1000003, i % 17, i % 31, i % 500, i * 13 % 100000, i % 28 + 1, i % 60,
+        i * 7 % 60);
+}
+
+void run(const char *name, CodecBase *sender, CodecBase *receiver, const vector<string> &msgs) {
+    unique_ptr<CodecBase> s(sender), r(receiver);
+    size_t raw = 0, wire = 0;
+    Buffer buf;
+    int64_t encodeUs = 0, decodeUs = 0;
+    for (auto &m : msgs) {
+        raw += m.size();
+        int64_t t0 = util::steadyMicro();
+        s->encode(m, buf);
+        int64_t t1 = util::steadyMicro();
+        Slice msg;
+        int n = r->tryDecode(buf, msg);
+        exitif(n <= 0 || msg != Slice(m), "decode failed");
+        // returning 0 ends a round, as the connections do
+        Slice rest(buf.data() + n, buf.size() - n), none;
+        r->tryDecode(rest, none);
+        decodeUs += util::steadyMicro() - t1;
+        encodeUs += t1 - t0;
+        wire += n;
+        buf.consume(n);
+    }
+    printf("%-24s %6.1f%% of %lu bytes, encode %5.2f us/msg, decode %5.2f us/msg\n", name, wire * 100.0 / raw, raw, encodeUs * 1.0 / msgs.size(),
+           decodeUs * 1.0 / msgs.size());
+}
+
+int main(int argc, const char *argv[]) {
+    int n = argc > 1 ? atoi(argv[1]) : 100000;
+    vector<string> msgs;
+    for (int i = 0; i < n; i++) {
+        msgs.push_back(makeMsg(i));
+    }
+    string dict = makeMsg(0) + makeMsg(1);
+    run("LengthCodec", new LengthCodec, new LengthCodec, msgs);
+    run("ZlibCodec level 1", new ZlibCodec(new LengthCodec), new ZlibCodec(new LengthCodec), msgs);
+    run("ZlibCodec level 6", new ZlibCodec(new LengthCodec, 128, 6), new ZlibCodec(new LengthCodec, 128, 6), msgs);
+    run("ZlibCodec level 1 dict", new ZlibCodec(new LengthCodec, 128, 1, dict), new ZlibCodec(new LengthCodec, 128, 1, dict), msgs);
+    // below the threshold every message goes out as is
+    run("ZlibCodec threshold 1K", new ZlibCodec(new LengthCodec, 1024), new ZlibCodec(new LengthCodec, 1024), msgs);
+    return 0;
+}
+
+#else
+
+int main() {
+    printf("handy is built without zlib\n");
+    return 0;
+}
+
+#endif
@@ -0,0 +1,52 @@
+#include <handy/handy.h>
+
+using namespace std;
+using namespace handy;
+
+// usage: echo-bench [conns] [msg size] [seconds] [et]
+// 服务端与客户端各使用一个线程，每个连接发送一个消息，收到完整的回显后再发送下一个
+int main(int argc, const char *argv[]) {
+    int conns = argc > 1 ? atoi(argv[1]) : 100;
+    size_t msgSize = argc > 2 ? atoi(argv[2]) : 4096;
+    int seconds = argc > 3 ? atoi(argv[3]) : 5;
+    bool et = argc > 4 && string(argv[4]) == "et";
+    setloglevel("WARN");
+
+    EventBase svrBase;
+    svrBase.setEdgeTriggered(et);
+    TcpServerPtr svr = TcpServer::startServer(&svrBase, "127.0.0.1", 2099);
+    exitif(svr == NULL, "start tcp server failed");
+    svr->onConnRead([](const TcpConnPtr &con) { con->send(con->getInput()); });
+    thread th([&] { svrBase.loop(); });
+
+    EventBase base;
+    base.setEdgeTriggered(et);
+    string msg(msgSize, 'a');
+    long rounds = 0;
+    vector<TcpConnPtr> cons;
+    for (int i = 0; i < conns; i++) {
+        TcpConnPtr con = TcpConn::createConnection(&base, "127.0.0.1", 2099);
+        con->onState([&](const TcpConnPtr &con) {
+            if (con->getState() == TcpConn::Connected) {
+                con->send(msg);
+            }
+        });
+        con->onRead([&](const TcpConnPtr &con) {
+            Buffer &input = con->getInput();
+            while (input.size() >= msgSize) {
+                input.consume(msgSize);
+                rounds++;
+                con->send(msg);
+            }
+        });
+        cons.push_back(con);
+    }
+    int64_t start = util::steadyMicro();
+    base.runAfter(seconds * 1000, [&] { base.exit(); });
+    base.loop();
+    double used = (util::steadyMicro() - start) / 1000000.0;
+    printf("%s conns %d msg %lu: %.0f rounds/s %.1f MB/s\n", et ? "edge" : "level", conns, msgSize, rounds / used, rounds * msgSize / used / 1024 / 1024);
+    svrBase.exit();
+    th.join();
+    return 0;
+}
@@ -0,0 +1,95 @@
+#include <handy/handy.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+using namespace std;
+using namespace handy;
+
+// usage: fanout-bench [copy|chain] [conns] [msg size] [rounds]
+// 服务端把一个消息广播给所有连接，copy为每个连接调用sendMsg，chain为编码一次后把同一个ChainBuffer发给所有连接
+// 客户端在子进程中建立连接并读取数据，一轮广播全部发送完成后开始下一轮
+int main(int argc, const char *argv[]) {
+    bool chain = argc > 1 && string(argv[1]) == "chain";
+    int conns = argc > 2 ? atoi(argv[2]) : 10000;
+    size_t msgSize = argc > 3 ? atoi(argv[3]) : 4096;
+    int rounds = argc > 4 ? atoi(argv[4]) : 20;
+    setloglevel("WARN");
+
+    pid_t pid = fork();
+    exitif(pid < 0, "fork failed %d %s", errno, strerror(errno));
+    if (pid == 0) {
+        usleep(200 * 1000);
+        EventBase base;
+        vector<TcpConnPtr> cons;
+        int closed = 0;
+        for (int i = 0; i < conns; i++) {
+            TcpConnPtr con = TcpConn::createConnection(&base, "127.0.0.1", 2099);
+            con->onRead([](const TcpConnPtr &con) { con->getInput().clear(); });
+            con->onState([&](const TcpConnPtr &con) {
+                if (con->getState() == TcpConn::Closed || con->getState() == TcpConn::Failed) {
+                    if (++closed == conns) {
+                        base.exit();
+                    }
+                }
+            });
+            cons.push_back(con);
+        }
+        base.loop();
+        return 0;
+    }
+
+    EventBase base;
+    TcpServerPtr svr = TcpServer::startServer(&base, "127.0.0.1", 2099);
+    exitif(svr == NULL, "start tcp server failed");
+    vector<TcpConnPtr> cons;
+    svr->onConnState([&](const TcpConnPtr &con) {
+        if (con->getState() == TcpConn::Connected) {
+            cons.push_back(con);
+        }
+    });
+    svr->onConnRead([](const TcpConnPtr &con) { con->getInput().clear(); });
+    while (cons.size() < (size_t) conns) {
+        base.loop_once(100);
+    }
+    string msg(msgSize, 'a');
+    LengthCodec codec;
+    int64_t sendUsed = 0, start = util::steadyMicro();
+    for (int r = 0; r < rounds; r++) {
+        int64_t t = util::steadyMicro();
+        if (chain) {
+            ChainBuffer buf;
+            buf.appendMsg(&codec, msg);
+            for (auto &con : cons) {
+                con->send(buf);
+            }
+        } else {
+            for (auto &con : cons) {
+                codec.encode(msg, con->getOutput());
+                con->sendOutput();
+            }
+        }
+        sendUsed += util::steadyMicro() - t;
+        for (;;) {
+            size_t pending = 0;
+            for (auto &con : cons) {
+                pending += con->writable();
+            }
+            if (pending == 0) {
+                break;
+            }
+            base.loop_once(100);
+        }
+    }
+    double used = (util::steadyMicro() - start) / 1000000.0;
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    printf("%s conns %d msg %lu: broadcast %.1f us/round, %.1f MB/s delivered, max rss %ld MB\n", chain ? "chain" : "copy", conns, msgSize,
+           sendUsed * 1.0 / rounds, (double) conns * msgSize * rounds / used / 1024 / 1024, ru.ru_maxrss / 1024);
+    for (auto &con : cons) {
+        con->close();
+    }
+    cons.clear();
+    base.loop_once(100);
+    waitpid(pid, NULL, 0);
+    return 0;
+}
@@ -0,0 +1,79 @@
+#include <handy/handy.h>
+#include <algorithm>
+
+using namespace std;
+using namespace handy;
+
+// usage: place-bench [rr|conns|busy|hash] [loops] [seconds]
+// 服务端使用MultiBase，客户端分批建立连接，每批有一个重连接和若干轻连接
+// 重连接的每个请求在服务端消耗300us，轮流分配时所有重连接落在同一个事件派发器上
+// 统计轻连接请求的延迟分布
+int main(int argc, const char *argv[]) {
+    string policy = argc > 1 ? argv[1] : "rr";
+    int loops = argc > 2 ? atoi(argv[2]) : 4;
+    int seconds = argc > 3 ? atoi(argv[3]) : 5;
+    setloglevel("WARN");
+
+    MultiBase svrBases(loops);
+    svrBases.setPolicy(policy == "conns" ? BasePolicy::LeastConns
+                                         : policy == "busy" ? BasePolicy::LeastBusy : policy == "hash" ? BasePolicy::PeerHash : BasePolicy::RoundRobin);
+    TcpServerPtr svr = TcpServer::startServer(&svrBases, "127.0.0.1", 2099);
+    exitif(svr == NULL, "start tcp server failed");
+    svr->onConnRead([](const TcpConnPtr &con) {
+        Buffer &input = con->getInput();
+        if (input.size() && input.data()[0] == 'H') {
+            int64_t end = util::steadyMicro() + 300;
+            while (util::steadyMicro() < end) {
+            }
+        }
+        con->send(input);
+    });
+    thread th([&] { svrBases.loop(); });
+
+    EventBase base;
+    string heavy(64, 'H'), light(64, 'L');
+    vector<TcpConnPtr> cons;
+    vector<int64_t> lats;
+    bool measuring = false;
+    for (int wave = 0; wave < loops; wave++) {
+        // busy time is published once per second, leave the loops time to report the new load
+        base.runAfter(wave * 1200, [&, wave] {
+            for (int i = 0; i < loops; i++) {
+                bool isHeavy = i == 0;
+                TcpConnPtr con = TcpConn::createConnection(&base, "127.0.0.1", 2099);
+                shared_ptr<int64_t> sent(new int64_t(0));
+                con->onState([=, &heavy, &light](const TcpConnPtr &con) {
+                    if (con->getState() == TcpConn::Connected) {
+                        *sent = util::steadyMicro();
+                        con->send(isHeavy ? heavy : light);
+                    }
+                });
+                con->onRead([=, &heavy, &light, &lats, &measuring](const TcpConnPtr &con) {
+                    Buffer &input = con->getInput();
+                    while (input.size() >= 64) {
+                        input.consume(64);
+                        int64_t now = util::steadyMicro();
+                        if (!isHeavy && measuring) {
+                            lats.push_back(now - *sent);
+                        }
+                        *sent = now;
+                        con->send(isHeavy ? heavy : light);
+                    }
+                });
+                cons.push_back(con);
+            }
+        });
+    }
+    base.runAfter(loops * 1200, [&] { measuring = true; });
+    base.runAfter(loops * 1200 + seconds * 1000, [&] { base.exit(); });
+    base.loop();
+    sort(lats.begin(), lats.end());
+    size_t n = lats.size();
+    if (n) {
+        printf("%s loops %d: %lu light requests, p50 %lld us p99 %lld us p999 %lld us\n", policy.c_str(), loops, n, (long long) lats[n / 2],
+               (long long) lats[n * 99 / 100], (long long) lats[n * 999 / 1000]);
+    }
+    svrBases.exit();
+    th.join();
+    return 0;
+}
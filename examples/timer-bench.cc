@@ -0,0 +1,47 @@
+#include <handy/handy.h>
+#include <random>
+
+using namespace std;
+using namespace handy;
+
+// usage: timer-bench [timers]
+// 测量大量定时器下 runAfter/cancel 的开销，以及事件循环的处理速度
+int main(int argc, const char *argv[]) {
+    int n = argc > 1 ? atoi(argv[1]) : 1000 * 1000;
+    EventBase base;
+    mt19937 rnd(n);
+    vector<TimerId> ids(n);
+    long fired = 0;
+
+    int64_t t0 = util::steadyMicro();
+    for (int i = 0; i < n; i++) {
+        ids[i] = base.runAfter(rnd() % 600000 + 1000, [&] { fired++; });
+    }
+    int64_t t1 = util::steadyMicro();
+    for (int i = 0; i < n; i += 2) {
+        base.cancel(ids[i]);
+    }
+    int64_t t2 = util::steadyMicro();
+    printf("%d timers: runAfter %.1f ns/op, cancel %.1f ns/op\n", n, (t1 - t0) * 1000.0 / n, (t2 - t1) * 2000.0 / n);
+
+    int loops = 1000;
+    for (int i = 0; i < loops; i++) {
+        base.loop_once(0);
+    }
+    int64_t t3 = util::steadyMicro();
+    printf("loop_once with %d live timers: %.2f us/op\n", n - n / 2, (t3 - t2) * 1.0 / loops);
+
+    // 在1秒内全部到期，测量触发的吞吐
+    for (int i = 0; i < n; i++) {
+        base.runAfter(rnd() % 1000, [&] { fired++; });
+    }
+    int64_t t4 = util::steadyMicro();
+    while (fired < n) {
+        base.loop_once(1);
+    }
+    int64_t t5 = util::steadyMicro();
+    printf("%d timers fired in %.0f ms\n", n, (t5 - t4) / 1000.0);
+    base.exit();
+    base.loop();
+    return 0;
+}
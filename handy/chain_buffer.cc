@@ -0,0 +1,141 @@
+#include "chain_buffer.h"
+
+using namespace std;
+
+namespace handy {
+
+namespace {
+
+// small appends share one block of this size
+const size_t kBlockSize = 4096;
+
+}  // namespace
+
+ChainBuffer &ChainBuffer::append(const char *p, size_t len) {
+    if (len == 0) {
+        return *this;
+    }
+    size_ += len;
+    if (pieces_.size()) {
+        // the tail of a block owned only by this chain can still be written
+        Piece &last = pieces_.back();
+        Buffer *b = last.block.get();
+        if (last.block.use_count() == 1 && last.data.end() == b->end() && b->space()) {
+            size_t n = min(len, b->space());
+            b->append(p, n);
+            last.data = Slice(last.data.data(), last.data.size() + n);
+            p += n;
+            len -= n;
+        }
+    }
+    if (len) {
+        shared_ptr<Buffer> b(new Buffer);
+        b->makeRoom(max(len, kBlockSize));
+        b->append(p, len);
+        pieces_.push_back(Piece{b, Slice(b->data(), len)});
+    }
+    return *this;
+}
+
+ChainBuffer &ChainBuffer::append(const ChainBuffer &other) {
+    // other may be this, take the size before appending
+    size_t n = other.pieces_.size();
+    size_ += other.size_;
+    for (size_t i = 0; i < n; i++) {
+        pieces_.push_back(other.pieces_[i]);
+    }
+    return *this;
+}
+
+ChainBuffer &ChainBuffer::absorb(Buffer &buf) {
+    if (buf.size()) {
+        shared_ptr<Buffer> b(new Buffer);
+        b->absorb(buf);
+        size_ += b->size();
+        pieces_.push_back(Piece{b, Slice(b->data(), b->size())});
+    }
+    return *this;
+}
+
+ChainBuffer &ChainBuffer::appendMsg(CodecBase *codec, const ChainBuffer &msg) {
+    ChainBuffer body = msg;
+    if (body.pieces_.size() > 1) {
+        // codecs work on contiguous data, join the pieces once
+        Buffer b;
+        msg.copyTo(b);
+        body.clear();
+        body.absorb(b);
+    }
+    Slice data = body.pieces_.size() ? body.pieces_[0].data : Slice();
+    CodecFrame frame;
+    if (!codec->encodeFrame(data, frame)) {
+        Buffer b;
+        codec->encode(data, b);
+        return absorb(b);
+    }
+    append(frame.head, frame.headLen);
+    append(body);
+    return append(frame.tail, frame.tailLen);
+}
+
+ChainBuffer &ChainBuffer::appendMsg(CodecBase *codec, Slice msg) {
+    CodecFrame frame;
+    if (!codec->encodeFrame(msg, frame)) {
+        Buffer b;
+        codec->encode(msg, b);
+        return absorb(b);
+    }
+    return append(frame.head, frame.headLen).append(msg).append(frame.tail, frame.tailLen);
+}
+
+ChainBuffer &ChainBuffer::consume(size_t len) {
+    len = min(len, size_);
+    size_ -= len;
+    size_t i = 0;
+    while (len && len >= pieces_[i].data.size()) {
+        len -= pieces_[i++].data.size();
+    }
+    pieces_.erase(pieces_.begin(), pieces_.begin() + i);
+    if (len) {
+        pieces_[0].data.eat(len);
+    }
+    return *this;
+}
+
+ChainBuffer ChainBuffer::sub(size_t off, size_t len) const {
+    ChainBuffer r;
+    for (const Piece &piece : pieces_) {
+        if (len == 0) {
+            break;
+        }
+        if (off >= piece.data.size()) {
+            off -= piece.data.size();
+            continue;
+        }
+        size_t n = min(len, piece.data.size() - off);
+        r.pieces_.push_back(Piece{piece.block, Slice(piece.data.data() + off, n)});
+        r.size_ += n;
+        len -= n;
+        off = 0;
+    }
+    return r;
+}
+
+void ChainBuffer::copyTo(Buffer &buf) const {
+    char *p = buf.allocRoom(size_);
+    for (const Piece &piece : pieces_) {
+        memcpy(p, piece.data.data(), piece.data.size());
+        p += piece.data.size();
+    }
+}
+
+string ChainBuffer::toString() const {
+    string s;
+    s.reserve(size_);
+    for (const Piece &piece : pieces_) {
+        s.append(piece.data.data(), piece.data.size());
+    }
+    return s;
+}
+
+}  // namespace handy
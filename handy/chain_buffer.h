@@ -0,0 +1,50 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <vector>
+#include "codec.h"
+#include "net.h"
+
+namespace handy {
+
+//由引用计数的内存块串成的缓冲区。复制、切片以及追加其他ChainBuffer时只增加块的引用计数，不复制数据
+//同一份数据可以同时放入多个TcpConn的输出队列，用于一对多的广播。已写入的数据不会被修改
+struct ChainBuffer {
+    //一段数据，block持有data所在的内存
+    struct Piece {
+        std::shared_ptr<Buffer> block;
+        Slice data;
+    };
+    ChainBuffer() : size_(0) {}
+    explicit ChainBuffer(Slice s) : size_(0) { append(s); }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    void clear() {
+        pieces_.clear();
+        size_ = 0;
+    }
+    //复制数据。最后一个块没有被共享且有剩余空间时写入该块，否则分配新块
+    ChainBuffer &append(const char *p, size_t len);
+    ChainBuffer &append(Slice s) { return append(s.data(), s.size()); }
+    //共享other中的块，不复制
+    ChainBuffer &append(const ChainBuffer &other);
+    //接管buf的内存，不复制，buf被清空
+    ChainBuffer &absorb(Buffer &buf);
+    //用codec编码msg后追加。codec支持encodeFrame时只复制帧头与帧尾，msg的块被共享
+    ChainBuffer &appendMsg(CodecBase *codec, const ChainBuffer &msg);
+    ChainBuffer &appendMsg(CodecBase *codec, Slice msg);
+    //丢弃开头的len字节
+    ChainBuffer &consume(size_t len);
+    //从off开始的len字节，与当前对象共享块
+    ChainBuffer sub(size_t off, size_t len) const;
+    //复制到buf的末尾
+    void copyTo(Buffer &buf) const;
+    std::string toString() const;
+    const std::vector<Piece> &pieces() const { return pieces_; }
+
+   private:
+    std::vector<Piece> pieces_;
+    size_t size_;
+};
+
+}  // namespace handy
@@ -1,4 +1,6 @@
 #include "codec.h"
+#include "frame_codec.h"
+#include "logging.h"
 
 using namespace std;
 
@@ -9,22 +11,30 @@ int LineCodec::tryDecode(Slice data, Slice &msg) {
         msg = data;
         return 1;
     }
-    for (size_t i = 0; i < data.size(); i++) {
-        if (data[i] == '\n') {
-            if (i > 0 && data[i - 1] == '\r') {
-                msg = Slice(data.data(), i - 1);
-                return static_cast<int>(i + 1);
-            } else {
-                msg = Slice(data.data(), i);
-                return static_cast<int>(i + 1);
-            }
-        }
+    // resume after the bytes scanned by the last call, memchr is vectorized by libc
+    size_t from = scanned_ <= data.size() ? scanned_ : 0;
+    // an empty data may have no memory behind it, memchr must not get a null pointer
+    const char *p = from < data.size() ? (const char *) memchr(data.data() + from, '\n', data.size() - from) : NULL;
+    if (p == NULL) {
+        scanned_ = data.size();
+        return maxLine_ && data.size() > maxLine_ ? -1 : 0;
     }
-    return 0;
+    scanned_ = 0;
+    size_t i = p - data.data();
+    if (maxLine_ && i > maxLine_) {
+        return -1;
+    }
+    msg = Slice(data.data(), i > 0 && data[i - 1] == '\r' ? i - 1 : i);
+    return static_cast<int>(i + 1);
 }
 void LineCodec::encode(Slice msg, Buffer &buf) {
     buf.append(msg).append("\r\n");
 }
+bool LineCodec::encodeFrame(Slice msg, CodecFrame &frame) {
+    memcpy(frame.tail, "\r\n", 2);
+    frame.tailLen = 2;
+    return true;
+}
 
 int LengthCodec::tryDecode(Slice data, Slice &msg) {
     if (data.size() < 8) {
@@ -43,5 +53,16 @@ int LengthCodec::tryDecode(Slice data, Slice &msg) {
 void LengthCodec::encode(Slice msg, Buffer &buf) {
     buf.append("mBdT").appendValue(net::hton((int32_t) msg.size())).append(msg);
 }
+bool LengthCodec::encodeFrame(Slice msg, CodecFrame &frame) {
+    int32_t len = net::hton((int32_t) msg.size());
+    memcpy(frame.head, "mBdT", 4);
+    memcpy(frame.head + 4, &len, 4);
+    frame.headLen = 8;
+    return true;
+}
+
+void frameTooLarge(size_t len, size_t maxLen) {
+    error("msg len %lu exceeds the max len %lu of the frame, dropped", len, maxLen);
+}
 
 }  // namespace handy
\ No newline at end of file
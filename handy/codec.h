@@ -3,27 +3,48 @@
 #include "slice.h"
 namespace handy {
 
+//消息的帧头与帧尾，发送时与消息一起通过writev写出，不需要把消息复制到输出缓冲区
+struct CodecFrame {
+    CodecFrame() : headLen(0), tailLen(0) {}
+    char head[32], tail[32];
+    size_t headLen, tailLen;
+};
+
 struct CodecBase {
     // > 0 解析出完整消息，消息放在msg中，返回已扫描的字节数
     // == 0 解析部分消息
     // < 0 解析错误
     virtual int tryDecode(Slice data, Slice &msg) = 0;
     virtual void encode(Slice msg, Buffer &buf) = 0;
+    //把msg的帧头与帧尾放到frame中，与encode的结果一致。返回false表示不支持，此时使用encode
+    virtual bool encodeFrame(Slice msg, CodecFrame &frame) { return false; }
     virtual CodecBase *clone() = 0;
+    //连接重新建立时调用，有状态的codec在此清除上一个连接留下的状态
+    virtual void reset() {}
     virtual ~CodecBase() = default;
 };
 
 //以\r\n结尾的消息
+//解析到部分消息时记录已扫描的长度，下次调用从该位置继续查找换行，因此两次调用之间data只能在末尾追加数据
 struct LineCodec : public CodecBase {
+    // maxLine为一行的最大长度，超过后解析出错，0为不限制
+    explicit LineCodec(size_t maxLine = 0) : maxLine_(maxLine), scanned_(0) {}
     int tryDecode(Slice data, Slice &msg) override;
     void encode(Slice msg, Buffer &buf) override;
-    CodecBase *clone() override { return new LineCodec(); }
+    bool encodeFrame(Slice msg, CodecFrame &frame) override;
+    CodecBase *clone() override { return new LineCodec(maxLine_); }
+    void reset() override { scanned_ = 0; }
+
+   private:
+    size_t maxLine_;
+    size_t scanned_;  //已扫描过且不含换行的字节数
 };
 
 //给出长度的消息
 struct LengthCodec : public CodecBase {
     int tryDecode(Slice data, Slice &msg) override;
     void encode(Slice msg, Buffer &buf) override;
+    bool encodeFrame(Slice msg, CodecFrame &frame) override;
     CodecBase *clone() override { return new LengthCodec(); }
 };
 
@@ -1,5 +1,6 @@
 #include "conn.h"
 #include <fcntl.h>
+#include <netinet/tcp.h>
 #include <poll.h>
 #include "logging.h"
 #include "poller.h"
@@ -7,22 +8,46 @@
 using namespace std;
 namespace handy {
 
-void handyUnregisterIdle(EventBase *base, const IdleId &idle);
-void handyUpdateIdle(EventBase *base, const IdleId &idle);
+void handyUnregisterIdle(EventBase *base, IdleNode *node);
+void handyConnCount(EventBase *base, int delta);
 
-void TcpConn::attach(EventBase *base, int fd, Ip4Addr local, Ip4Addr peer) {
+void TcpConn::attach(EventBase *base, int fd, Ip4Addr local, Ip4Addr peer, bool nonBlocking) {
     fatalif((destPort_ <= 0 && state_ != State::Invalid) || (destPort_ >= 0 && state_ != State::Handshaking),
             "you should use a new TcpConn to attach. state: %d", state_);
     base_ = base;
     state_ = State::Handshaking;
     local_ = local;
     peer_ = peer;
-    delete channel_;
-    channel_ = new Channel(base, fd, kWriteEvent | kReadEvent);
+    if (channel_) {
+        handyConnCount(channel_->getBase(), -1);
+        delete channel_;
+    }
+    channel_ = new Channel(base, fd, kWriteEvent | kReadEvent, base->edgeTriggered(), nonBlocking);
+    // a reconnected peer knows nothing of the codec state of the last connection
+    if (codec_) {
+        codec_->reset();
+    }
+    handyConnCount(base, 1);
     trace("tcp constructed %s - %s fd: %d", local_.toString().c_str(), peer_.toString().c_str(), fd);
     TcpConnPtr con = shared_from_this();
-    con->channel_->onRead([=] { con->handleRead(con); });
-    con->channel_->onWrite([=] { con->handleWrite(con); });
+    // closing the connection from a callback deletes the channel with these closures, and their copy of con
+    // may be the last reference. a local copy keeps the connection alive until the handler returns
+    con->channel_->onRead([=] {
+        TcpConnPtr c = con;
+        c->handleRead(c);
+    });
+    con->channel_->onWrite([=] {
+        TcpConnPtr c = con;
+        c->handleWrite(c);
+    });
+    con->channel_->onReadDone([=](int res) {
+        TcpConnPtr c = con;
+        c->handleReadDone(c, res);
+    });
+    con->channel_->onWriteDone([=](int res) {
+        TcpConnPtr c = con;
+        c->handleWriteDone(c, res);
+    });
 }
 
 void TcpConn::connect(EventBase *base, const string &host, unsigned short port, int timeout, const string &localip) {
@@ -52,15 +77,17 @@ void TcpConn::connect(EventBase *base, const string &host, unsigned short port,
     }
 
     sockaddr_in local;
+    memset(&local, 0, sizeof local);
     socklen_t alen = sizeof(local);
-    if (r == 0) {
+    // the local address is assigned when connect starts, a non-blocking connect is usually still in progress
+    if (r == 0 || errno == EINPROGRESS) {
         r = getsockname(fd, (sockaddr *) &local, &alen);
         if (r < 0) {
             error("getsockname failed %d %s", errno, strerror(errno));
         }
     }
     state_ = State::Handshaking;
-    attach(base, fd, Ip4Addr(local), addr);
+    attach(base, fd, Ip4Addr(local), addr, true);
     if (timeout) {
         TcpConnPtr con = shared_from_this();
         timeoutId_ = base->runAfter(timeout, [con] {
@@ -82,6 +109,8 @@ void TcpConn::close() {
 }
 
 void TcpConn::cleanup(const TcpConnPtr &con) {
+    // the requests in flight were cancelled with the channel, they hold the memory they reference
+    uring_ = reading_ = writing_ = false;
     if (readcb_ && input_.size()) {
         readcb_(con);
     }
@@ -99,13 +128,20 @@ void TcpConn::cleanup(const TcpConnPtr &con) {
         reconnect();
         return;
     }
-    for (auto &idle : idleIds_) {
-        handyUnregisterIdle(getBase(), idle);
+    for (IdleNode *node = &idle_; node; node = node->next_.get()) {
+        handyUnregisterIdle(getBase(), node);
     }
     // channel may have hold TcpConnPtr, set channel_ to NULL before delete
-    readcb_ = writablecb_ = statecb_ = nullptr;
+    readcb_ = writablecb_ = statecb_ = highcb_ = lowcb_ = nullptr;
     Channel *ch = channel_;
     channel_ = NULL;
+    if (ch) {
+        handyConnCount(ch->getBase(), -1);
+    }
+    if (serverStats_) {
+        serverStats_->conns--;
+        serverStats_.reset();
+    }
     delete ch;
 }
 
@@ -113,32 +149,86 @@ void TcpConn::handleRead(const TcpConnPtr &con) {
     if (state_ == State::Handshaking && handleHandshake(con)) {
         return;
     }
+    // reads are submitted to io_uring, only the close of the channel comes here
+    if (uring_) {
+        if (channel_->fd() < 0) {
+            cleanup(con);
+        }
+        return;
+    }
+    // a burst larger than the free space of input_ spills into the stack and is appended once,
+    // so an idle connection keeps an empty input_ and does not grow it before reading
+    char extra[65536];
+    // a bulk stream reads straight into input_, sized by the average bytes of a read event
+    const size_t kBulk = 4096, kMaxRoom = 65536;
+    if (readAvg_ > kBulk && input_.space() < readAvg_) {
+        input_.makeRoom(min(readAvg_, kMaxRoom));
+    }
+    size_t readed = 0, total = 0, budget = getBase()->readBudget();
     while (state_ == State::Connected) {
-        input_.makeRoom();
+        struct iovec iov[2] = {{input_.end(), input_.space()}, {extra, sizeof extra}};
         int rd = 0;
         if (channel_->fd() >= 0) {
-            rd = readImp(channel_->fd(), input_.end(), input_.space());
+            rd = readvImp(channel_->fd(), iov, 2);
             trace("channel %lld fd %d readed %d bytes", (long long) channel_->id(), channel_->fd(), rd);
         }
+        // with level triggered a short read means the socket is drained, skip the read that would return EAGAIN
+        bool drained = rd > 0 && (size_t) rd < iov[0].iov_len + iov[1].iov_len && !channel_->edgeTriggered();
+        if (rd > 0) {
+            readed += rd;
+            total += rd;
+            size_t n = min((size_t) rd, iov[0].iov_len);
+            input_.addSize(n);
+            if ((size_t) rd > n) {
+                input_.append(extra, rd - n);
+            }
+        }
+        // when the output watermark pauses reading, the input is delivered once it reaches the high mark, so the
+        // output produced by the callback can pause reading before the whole socket buffer is read in
+        bool full = rd > 0 && pauseOnHigh_ && highWater_ && input_.size() >= highWater_;
+        bool overBudget = rd > 0 && budget && total >= budget;
         if (rd == -1 && errno == EINTR) {
             continue;
-        } else if (rd == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-            for (auto &idle : idleIds_) {
-                handyUpdateIdle(getBase(), idle);
+        } else if (drained || full || overBudget || (rd == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))) {
+            // only a timestamp is updated, the idle wheel checks it when the node expires
+            for (IdleNode *node = &idle_; node; node = node->next_.get()) {
+                node->updated_ = getBase()->now();
             }
             if (readcb_ && input_.size()) {
                 readcb_(con);
             }
+            adaptInput(readed);
+            readed = 0;
+            if (overBudget && !drained) {
+                // level triggered reports the rest in the next poll, edge triggered brings no new edge for it
+                if (state_ == State::Connected && !readPaused_ && channel_->edgeTriggered()) {
+                    getBase()->safeCall([con] {
+                        if (con->channel_ && !con->readPaused_) {
+                            con->handleRead(con);
+                        }
+                    });
+                }
+            } else if (full && !drained && !readPaused_) {
+                continue;
+            }
             break;
         } else if (channel_->fd() == -1 || rd == 0 || rd == -1) {
             cleanup(con);
             break;
-        } else {  // rd > 0
-            input_.addSize(rd);
         }
     }
 }
 
+void TcpConn::adaptInput(size_t readed) {
+    // moving average with a weight of 1/8 for the latest event
+    readAvg_ = readAvg_ - readAvg_ / 8 + readed / 8;
+    // a buffer left large by a burst is shrunk once the connection turns chatty or idle
+    size_t want = max(readAvg_, input_.size());
+    if (input_.capacity() > 4096 && input_.capacity() > 4 * want) {
+        input_.shrink(want);
+    }
+}
+
 int TcpConn::handleHandshake(const TcpConnPtr &con) {
     fatalif(state_ != Handshaking, "handleHandshaking called when state_=%d", state_);
     struct pollfd pfd;
@@ -146,7 +236,17 @@ int TcpConn::handleHandshake(const TcpConnPtr &con) {
     pfd.events = POLLOUT | POLLERR;
     int r = poll(&pfd, 1, 0);
     if (r == 1 && pfd.revents == POLLOUT) {
-        channel_->enableReadWrite(true, false);
+        // connections such as SSLConn read and write through readImp/writeImp, they stay on readiness events
+        if (channel_->completion() && rawSocketIo()) {
+            uring_ = true;
+            if (!readBlock_ || readBlock_.use_count() > 1) {
+                readBlock_.reset(new Buffer);  // the old one may still be the target of a cancelled read
+            }
+            channel_->enableReadWrite(false, false);
+        } else {
+            // data sent while connecting is flushed once connected
+            channel_->enableReadWrite(true, outq_.size() || output_.size());
+        }
         state_ = State::Connected;
         if (state_ == State::Connected) {
             connectedTime_ = util::timeMilli();
@@ -155,6 +255,10 @@ int TcpConn::handleHandshake(const TcpConnPtr &con) {
                 statecb_(con);
             }
         }
+        if (uring_ && channel_) {
+            startRead();
+            startWrite();
+        }
     } else {
         trace("poll fd %d return %d revents %d", channel_->fd(), r, pfd.revents);
         cleanup(con);
@@ -163,16 +267,120 @@ int TcpConn::handleHandshake(const TcpConnPtr &con) {
     return 0;
 }
 
+void TcpConn::startRead() {
+    if (!uring_ || reading_ || readPaused_ || state_ != State::Connected) {
+        return;
+    }
+    const size_t kMinRoom = 4096, kMaxRoom = 65536;
+    char *p = readBlock_->makeRoom(min(max(readAvg_, kMinRoom), kMaxRoom));
+    reading_ = true;
+    channel_->submitRead(p, readBlock_->space(), readBlock_);
+}
+
+void TcpConn::handleReadDone(const TcpConnPtr &con, int res) {
+    reading_ = false;
+    if (state_ != State::Connected) {
+        return;
+    }
+    if (res == -EINTR || res == -EAGAIN) {
+        startRead();
+        return;
+    } else if (res <= 0) {
+        if (res < 0) {
+            error("read error: channel %lld fd %d %d %s", (long long) channel_->id(), channel_->fd(), -res, strerror(-res));
+        }
+        channel_->close();
+        return;
+    }
+    readBlock_->addSize(res);
+    // an empty input_ swaps buffers with readBlock_, the data is not copied
+    input_.absorb(*readBlock_);
+    for (IdleNode *node = &idle_; node; node = node->next_.get()) {
+        node->updated_ = getBase()->now();
+    }
+    if (readcb_) {
+        readcb_(con);
+    }
+    adaptInput(res);
+    startRead();
+}
+
+void TcpConn::startWrite() {
+    if (!uring_ || writing_ || state_ != State::Connected) {
+        return;
+    }
+    if (output_.size()) {
+        shared_ptr<Buffer> b(new Buffer);
+        b->absorb(output_);
+        pushOutput(b, Slice(b->data(), b->size()));
+    }
+    const int kMaxIov = 64;
+    struct iovec iov[kMaxIov];
+    int cnt = 0;
+    // the request holds the blocks it writes, a cancelled write outlives the pops of outq_ after a reconnect.
+    // the vector is reused unless a cancelled write still holds it
+    if (!writeBlocks_ || writeBlocks_.use_count() > 1) {
+        writeBlocks_.reset(new vector<shared_ptr<void>>);
+    }
+    writeBlocks_->clear();
+    for (auto &b : outq_) {
+        if (cnt == kMaxIov) {
+            break;
+        }
+        iov[cnt].iov_base = (void *) b.data.data();
+        iov[cnt++].iov_len = b.data.size();
+        writeBlocks_->push_back(b.owner);
+    }
+    if (cnt) {
+        writing_ = true;
+        channel_->submitWrite(iov, cnt, writeBlocks_);
+    }
+}
+
+void TcpConn::handleWriteDone(const TcpConnPtr &con, int res) {
+    writing_ = false;
+    if (state_ != State::Connected) {
+        return;
+    }
+    if (res < 0 && res != -EINTR && res != -EAGAIN) {
+        error("writev error: channel %lld fd %d %d %s", (long long) channel_->id(), channel_->fd(), -res, strerror(-res));
+        channel_->close();
+        return;
+    }
+    size_t sended = max(res, 0);
+    outqSize_ -= min(sended, outqSize_);
+    while (outq_.size() && sended >= outq_.front().data.size()) {
+        sended -= outq_.front().data.size();
+        outq_.pop_front();
+    }
+    if (outq_.size()) {
+        outq_.front().data.eat(sended);
+    }
+    startWrite();
+    checkWatermark();
+    if (outq_.empty() && output_.empty() && writablecb_) {
+        writablecb_(con);
+    }
+}
+
+void TcpConn::wantWrite() {
+    if (uring_) {
+        startWrite();
+    } else if ((outq_.size() || output_.size()) && !channel_->writeEnabled()) {
+        channel_->enableWrite(true);
+    }
+}
+
 void TcpConn::handleWrite(const TcpConnPtr &con) {
     if (state_ == State::Handshaking) {
         handleHandshake(con);
     } else if (state_ == State::Connected) {
-        ssize_t sended = isend(output_.begin(), output_.size());
-        output_.consume(sended);
-        if (output_.empty() && writablecb_) {
+        flushOutput();
+        checkWatermark();
+        if (outq_.empty() && output_.empty() && writablecb_) {
             writablecb_(con);
         }
-        if (output_.empty() && channel_->writeEnabled()) {  // writablecb_ may write something
+        if (outq_.empty() && output_.empty() && channel_->writeEnabled()) {  // writablecb_ may write something
             channel_->enableWrite(false);
         }
     } else {
@@ -180,6 +388,50 @@ void TcpConn::handleWrite(const TcpConnPtr &con) {
     }
 }
 
+int TcpConn::readvImp(int fd, const struct iovec *iov, int cnt) {
+    if (rawSocketIo()) {
+        return ::readv(fd, iov, cnt);
+    }
+    int total = 0;
+    for (int i = 0; i < cnt; i++) {
+        if (iov[i].iov_len == 0) {
+            continue;
+        }
+        int rd = readImp(fd, iov[i].iov_base, iov[i].iov_len);
+        if (rd <= 0) {
+            // EOF or the error comes again in the next call if something is read
+            return total ? total : rd;
+        }
+        total += rd;
+        if ((size_t) rd < iov[i].iov_len) {
+            break;
+        }
+    }
+    return total;
+}
+
+int TcpConn::writevImp(int fd, const struct iovec *iov, int cnt) {
+    if (rawSocketIo()) {
+        return ::writev(fd, iov, cnt);
+    }
+    int total = 0;
+    for (int i = 0; i < cnt; i++) {
+        if (iov[i].iov_len == 0) {
+            continue;
+        }
+        int wd = writeImp(fd, iov[i].iov_base, iov[i].iov_len);
+        if (wd < 0) {
+            // the error comes again in the next call if something is written
+            return total ? total : wd;
+        }
+        total += wd;
+        if ((size_t) wd < iov[i].iov_len) {
+            break;
+        }
+    }
+    return total;
+}
+
 ssize_t TcpConn::isend(const char *buf, size_t len) {
     size_t sended = 0;
     while (len > sended) {
@@ -203,21 +455,163 @@ ssize_t TcpConn::isend(const char *buf, size_t len) {
     return sended;
 }
 
+ssize_t TcpConn::isendv(struct iovec *iov, int cnt) {
+    size_t sended = 0;
+    while (cnt) {
+        ssize_t wd = writevImp(channel_->fd(), iov, cnt);
+        trace("channel %lld fd %d writev %ld bytes", (long long) channel_->id(), channel_->fd(), wd);
+        if (wd > 0) {
+            sended += wd;
+            while (cnt && (size_t) wd >= iov->iov_len) {
+                wd -= iov->iov_len;
+                iov++;
+                cnt--;
+            }
+            if (cnt) {
+                iov->iov_base = (char *) iov->iov_base + wd;
+                iov->iov_len -= wd;
+            }
+            continue;
+        } else if (wd == -1 && errno == EINTR) {
+            continue;
+        } else if (wd == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (!channel_->writeEnabled()) {
+                channel_->enableWrite(true);
+            }
+            break;
+        } else {
+            error("writev error: channel %lld fd %d wd %ld %d %s", (long long) channel_->id(), channel_->fd(), wd, errno, strerror(errno));
+            break;
+        }
+    }
+    return sended;
+}
+
+void TcpConn::flushOutput() {
+    if (uring_) {
+        startWrite();
+        return;
+    }
+    const int kMaxIov = 64;
+    while (outq_.size() || output_.size()) {
+        struct iovec iov[kMaxIov];
+        int cnt = 0;
+        size_t total = 0;
+        for (auto &b : outq_) {
+            if (cnt == kMaxIov) {
+                break;
+            }
+            iov[cnt].iov_base = (void *) b.data.data();
+            iov[cnt].iov_len = b.data.size();
+            total += iov[cnt++].iov_len;
+        }
+        if (cnt < kMaxIov && output_.size()) {
+            iov[cnt].iov_base = output_.data();
+            iov[cnt].iov_len = output_.size();
+            total += iov[cnt++].iov_len;
+        }
+        size_t sended = isendv(iov, cnt);
+        outqSize_ -= min(sended, outqSize_);
+        while (outq_.size() && sended >= outq_.front().data.size()) {
+            sended -= outq_.front().data.size();
+            outq_.pop_front();
+        }
+        if (outq_.size()) {
+            outq_.front().data.eat(sended);
+        } else {
+            output_.consume(sended);
+        }
+        if (sended < total) {
+            break;
+        }
+    }
+}
+
+void TcpConn::queueOutput(Buffer &buf) {
+    if (&buf == &output_) {
+        return;
+    }
+    // a large buffer is moved behind the pending output instead of being copied into it
+    if (output_.size() && buf.size() >= 4096) {
+        shared_ptr<Buffer> b(new Buffer);
+        b->absorb(output_);
+        pushOutput(b, Slice(b->data(), b->size()));
+    }
+    output_.absorb(buf);
+}
+
+void TcpConn::pushOutput(const shared_ptr<void> &owner, Slice data) {
+    outq_.push_back(OutputBlock{owner, data});
+    outqSize_ += data.size();
+}
+
+void TcpConn::setWatermark(size_t high, size_t low, bool pauseRead, const TcpCallBack &highcb, const TcpCallBack &lowcb) {
+    highWater_ = high;
+    lowWater_ = low;
+    pauseOnHigh_ = pauseRead;
+    highcb_ = highcb;
+    lowcb_ = lowcb;
+    checkWatermark();
+}
+
+void TcpConn::checkWatermark() {
+    if (highWater_ == 0 || !channel_) {
+        return;
+    }
+    size_t sz = outputSize();
+    if (!aboveHigh_ && sz > highWater_) {
+        aboveHigh_ = true;
+        if (pauseOnHigh_) {
+            pauseRead(true);
+        }
+        if (highcb_) {
+            highcb_(shared_from_this());
+        }
+    } else if (aboveHigh_ && sz <= lowWater_) {
+        aboveHigh_ = false;
+        if (pauseOnHigh_) {
+            pauseRead(false);
+        }
+        if (lowcb_) {
+            lowcb_(shared_from_this());
+        }
+    }
+}
+
+void TcpConn::pauseRead(bool pause) {
+    if (!channel_ || readPaused_ == pause) {
+        return;
+    }
+    readPaused_ = pause;
+    if (uring_) {
+        // a read in flight completes as usual, the next one is not submitted while paused
+        startRead();
+        return;
+    }
+    channel_->enableRead(!pause);
+    if (!pause && channel_->edgeTriggered()) {
+        // the data already in the socket brings no new edge, read it in the next iteration
+        TcpConnPtr con = shared_from_this();
+        getBase()->safeCall([con] {
+            if (con->channel_ && !con->readPaused_) {
+                con->handleRead(con);
+            }
+        });
+    }
+}
+
 void TcpConn::send(Buffer &buf) {
     if (channel_) {
-        if (channel_->writeEnabled()) {  // just full
-            output_.absorb(buf);
-        }
-        if (buf.size()) {
+        // when the socket is just full, keep buf behind the pending data
+        if (!uring_ && !channel_->writeEnabled() && outq_.empty() && buf.size()) {
             ssize_t sended = isend(buf.begin(), buf.size());
             buf.consume(sended);
         }
         if (buf.size()) {
-            output_.absorb(buf);
-            if (!channel_->writeEnabled()) {
-                channel_->enableWrite(true);
-            }
+            queueOutput(buf);
+            wantWrite();
         }
+        checkWatermark();
     } else {
         warn("connection %s - %s closed, but still writing %lu bytes", local_.toString().c_str(), peer_.toString().c_str(), buf.size());
     }
@@ -225,19 +619,47 @@ void TcpConn::send(Buffer &buf) {
 
 void TcpConn::send(const char *buf, size_t len) {
     if (channel_) {
-        if (output_.empty()) {
+        if (!uring_ && output_.empty() && outq_.empty()) {
             ssize_t sended = isend(buf, len);
             buf += sended;
             len -= sended;
         }
         if (len) {
             output_.append(buf, len);
+            if (uring_) {
+                startWrite();
+            }
         }
+        checkWatermark();
     } else {
         warn("connection %s - %s closed, but still writing %lu bytes", local_.toString().c_str(), peer_.toString().c_str(), len);
     }
 }
 
+void TcpConn::send(const ChainBuffer &buf) {
+    if (channel_) {
+        bool pending = channel_->writeEnabled() || outq_.size();
+        if (output_.size() && buf.size() < 4096) {
+            buf.copyTo(output_);
+        } else {
+            if (output_.size()) {
+                shared_ptr<Buffer> b(new Buffer);
+                b->absorb(output_);
+                pushOutput(b, Slice(b->data(), b->size()));
+            }
+            for (auto &piece : buf.pieces()) {
+                pushOutput(piece.block, piece.data);
+            }
+        }
+        if (!pending) {
+            flushOutput();
+        }
+        checkWatermark();
+    } else {
+        warn("connection %s - %s closed, but still writing %lu bytes", local_.toString().c_str(), peer_.toString().c_str(), buf.size());
+    }
+}
+
 void TcpConn::onMsg(CodecBase *codec, const MsgCallBack &cb) {
     assert(!readcb_);
     codec_.reset(codec);
@@ -252,75 +674,240 @@ void TcpConn::onMsg(CodecBase *codec, const MsgCallBack &cb) {
             } else if (r > 0) {
                 trace("a msg decoded. origin len %d msg len %ld", r, msg.size());
                 cb(con, msg);
+                // closed by cb, the input is handled again from cleanup and this closure is destroyed
+                if (!con->channel_) {
+                    break;
+                }
                 con->getInput().consume(r);
             }
         }
     });
 }
 
+void TcpConn::onMsgs(CodecBase *codec, const MsgsCallBack &cb) {
+    assert(!readcb_);
+    codec_.reset(codec);
+    onRead([cb](const TcpConnPtr &con) {
+        // take the vector of the connection, a nested call from within cb finds it empty and gets its own
+        vector<Slice> msgs;
+        msgs.swap(con->msgs_);
+        msgs.clear();
+        Slice data = con->getInput();
+        int r = 1;
+        while (r > 0) {
+            Slice msg;
+            r = con->codec_->tryDecode(data, msg);
+            if (r > 0) {
+                msgs.push_back(msg);
+                data.eat(r);
+            }
+        }
+        size_t used = con->getInput().size() - data.size();
+        if (msgs.size()) {
+            trace("%lu msgs decoded", msgs.size());
+            cb(con, msgs);
+        }
+        // cb may close the connection, which delivers the input again from cleanup and destroys this closure.
+        // only con and the locals are used from here
+        con->getInput().consume(min(used, con->getInput().size()));
+        if (r < 0 && con->channel_) {
+            con->channel_->close();
+        } else if (con->channel_) {
+            con->msgs_.swap(msgs);
+        }
+    });
+}
+
 void TcpConn::sendMsg(Slice msg) {
-    codec_->encode(msg, getOutput());
-    sendOutput();
+    CodecFrame frame;
+    if (!channel_ || uring_ || channel_->writeEnabled() || outq_.size() || output_.size() || !codec_->encodeFrame(msg, frame)) {
+        codec_->encode(msg, getOutput());
+        sendOutput();
+        return;
+    }
+    // a frame without head or tail, or an empty msg, leaves empty parts, they are skipped
+    Slice parts[3] = {Slice(frame.head, frame.headLen), msg, Slice(frame.tail, frame.tailLen)};
+    struct iovec iov[3];
+    int cnt = 0;
+    for (Slice &part : parts) {
+        if (part.size()) {
+            iov[cnt].iov_base = (void *) part.data();
+            iov[cnt++].iov_len = part.size();
+        }
+    }
+    size_t sended = isendv(iov, cnt);
+    // only the unsent part is copied, msg is not valid after return
+    for (Slice &part : parts) {
+        size_t n = min(sended, part.size());
+        sended -= n;
+        if (part.size() > n) {
+            output_.append(part.data() + n, part.size() - n);
+        }
+    }
+    wantWrite();
+    checkWatermark();
+}
+
+void TcpConn::sendMsg(Buffer &msg) {
+    CodecFrame frame;
+    if (!channel_ || !codec_->encodeFrame(msg, frame)) {
+        codec_->encode(msg, getOutput());
+        msg.clear();
+        sendOutput();
+        return;
+    }
+    Slice head(frame.head, frame.headLen), tail(frame.tail, frame.tailLen);
+    size_t sended = 0;
+    if (!uring_ && !channel_->writeEnabled() && outq_.empty() && output_.empty()) {
+        Slice parts[3] = {head, msg, tail};
+        struct iovec iov[3];
+        int cnt = 0;
+        for (Slice &part : parts) {
+            if (part.size()) {
+                iov[cnt].iov_base = (void *) part.data();
+                iov[cnt++].iov_len = part.size();
+            }
+        }
+        sended = isendv(iov, cnt);
+    }
+    size_t n = min(sended, head.size());
+    if (head.size() > n) {
+        output_.append(head.data() + n, head.size() - n);
+    }
+    sended -= n;
+    n = min(sended, msg.size());
+    msg.consume(n);
+    sended -= n;
+    queueOutput(msg);
+    if (tail.size() > sended) {
+        output_.append(tail.data() + sended, tail.size() - sended);
+    }
+    wantWrite();
+    checkWatermark();
+}
+
+TcpServer::TcpServer(EventBases *bases) : base_(bases->allocBase()), bases_(bases), acceptPerLoop_(false), localFixed_(false),
+      backlog_(SOMAXCONN),
+      deferAccept_(0),
+      maxConns_(0),
+      maxConnsPerBase_(0),
+      stats_(new TcpServerStats),
+      createcb_([] { return TcpConnPtr(new TcpConn); }) {}
+
+TcpServer::~TcpServer() {
+    closeListeners();
 }
 
-TcpServer::TcpServer(EventBases *bases) : base_(bases->allocBase()), bases_(bases), listen_channel_(NULL), createcb_([] { return TcpConnPtr(new TcpConn); }) {}
+void TcpServer::closeListeners() {
+    for (Listener &l : listeners_) {
+        l.channel->getBase()->cancel(l.resume);
+        delete l.channel;
+        if (l.reserveFd >= 0) {
+            close(l.reserveFd);
+        }
+    }
+    listeners_.clear();
+}
 
-int TcpServer::bind(const std::string &host, unsigned short port, bool reusePort) {
+int TcpServer::bind(const std::string &host, unsigned short port, bool reusePort, bool acceptPerLoop) {
     addr_ = Ip4Addr(host, port);
-    int fd = socket(AF_INET, SOCK_STREAM, 0);
-    int r = net::setReuseAddr(fd);
-    fatalif(r, "set socket reuse option failed");
-    r = net::setReusePort(fd, reusePort);
-    fatalif(r, "set socket reuse port option failed");
-    r = util::addFdFlag(fd, FD_CLOEXEC);
-    fatalif(r, "addFdFlag FD_CLOEXEC failed");
-    r = ::bind(fd, (struct sockaddr *) &addr_.getAddr(), sizeof(struct sockaddr));
-    if (r) {
-        close(fd);
-        error("bind to %s failed %d %s", addr_.toString().c_str(), errno, strerror(errno));
-        return errno;
-    }
-    r = listen(fd, 20);
-    fatalif(r, "listen failed %d %s", errno, strerror(errno));
-    info("fd %d listening at %s", fd, addr_.toString().c_str());
-    listen_channel_ = new Channel(base_, fd, kReadEvent);
-    listen_channel_->onRead([this] { handleAccept(); });
+    acceptPerLoop_ = acceptPerLoop;
+    localFixed_ = addr_.ipInt() != INADDR_ANY;
+    int n = acceptPerLoop ? bases_->baseCount() : 1;
+    for (int i = 0; i < n; i++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        int r = net::setReuseAddr(fd);
+        fatalif(r, "set socket reuse option failed");
+        r = net::setReusePort(fd, reusePort || acceptPerLoop);
+        fatalif(r, "set socket reuse port option failed");
+        r = util::addFdFlag(fd, FD_CLOEXEC);
+        fatalif(r, "addFdFlag FD_CLOEXEC failed");
+        r = ::bind(fd, (struct sockaddr *) &addr_.getAddr(), sizeof(struct sockaddr));
+        if (r) {
+            int err = errno;
+            close(fd);
+            error("bind to %s failed %d %s", addr_.toString().c_str(), err, strerror(err));
+            closeListeners();
+            return err;
+        }
+#ifdef TCP_DEFER_ACCEPT
+        if (deferAccept_ > 0) {
+            r = setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &deferAccept_, sizeof deferAccept_);
+            fatalif(r, "set TCP_DEFER_ACCEPT failed %d %s", errno, strerror(errno));
+        }
+#endif
+        r = listen(fd, backlog_);
+        fatalif(r, "listen failed %d %s", errno, strerror(errno));
+        if (addr_.port() == 0) {
+            // an ephemeral port is chosen by the kernel, the other listeners reuse it
+            socklen_t alen = sizeof(struct sockaddr_in);
+            r = getsockname(fd, (struct sockaddr *) &addr_.getAddr(), &alen);
+            fatalif(r, "getsockname failed %d %s", errno, strerror(errno));
+        }
+        info("fd %d listening at %s", fd, addr_.toString().c_str());
+        Channel *ch = new Channel(acceptPerLoop ? bases_->getBase(i) : base_, fd, kReadEvent);
+        ch->onRead([this, i] { handleAccept(i); });
+        int reserve = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        listeners_.push_back(Listener{ch, reserve, 0, TimerId()});
+    }
     return 0;
 }
 
-TcpServerPtr TcpServer::startServer(EventBases *bases, const std::string &host, unsigned short port, bool reusePort) {
+TcpServerPtr TcpServer::startServer(EventBases *bases, const std::string &host, unsigned short port, bool reusePort, bool acceptPerLoop) {
     TcpServerPtr p(new TcpServer(bases));
-    int r = p->bind(host, port, reusePort);
+    int r = p->bind(host, port, reusePort, acceptPerLoop);
     if (r) {
         error("bind to %s:%d failed %d %s", host.c_str(), port, errno, strerror(errno));
     }
     return r == 0 ? p : NULL;
 }
 
-void TcpServer::handleAccept() {
+void TcpServer::handleAccept(int index) {
+    Listener &l = listeners_[index];
+    Channel *listen = l.channel;
+    int lfd = listen->fd();
+    int cfd;
     struct sockaddr_in raddr;
     socklen_t rsz = sizeof(raddr);
-    int lfd = listen_channel_->fd();
-    int cfd;
+    // the peer address comes from accept, the descriptor is created non-blocking and close-on-exec
+#ifdef OS_LINUX
+    while (lfd >= 0 && (cfd = accept4(lfd, (struct sockaddr *) &raddr, &rsz, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+#else
     while (lfd >= 0 && (cfd = accept(lfd, (struct sockaddr *) &raddr, &rsz)) >= 0) {
-        sockaddr_in peer, local;
-        socklen_t alen = sizeof(peer);
-        int r = getpeername(cfd, (sockaddr *) &peer, &alen);
-        if (r < 0) {
-            error("get peer name failed %d %s", errno, strerror(errno));
+        int r = util::addFdFlag(cfd, FD_CLOEXEC);
+        fatalif(r, "addFdFlag FD_CLOEXEC failed");
+        r = net::setNonBlock(cfd);
+        fatalif(r, "set non block failed");
+#endif
+        rsz = sizeof(raddr);
+        l.backoff = 0;
+        if (maxConns_ > 0 && stats_->conns >= maxConns_) {
+            close(cfd);
+            stats_->rejected++;
             continue;
         }
-        r = getsockname(cfd, (sockaddr *) &local, &alen);
-        if (r < 0) {
-            error("getsockname failed %d %s", errno, strerror(errno));
+        sockaddr_in peer = raddr, local = addr_.getAddr();
+        if (!localFixed_) {
+            socklen_t alen = sizeof(local);
+            if (getsockname(cfd, (sockaddr *) &local, &alen) < 0) {
+                error("getsockname failed %d %s", errno, strerror(errno));
+                close(cfd);
+                continue;
+            }
+        }
+        EventBase *b = acceptPerLoop_ ? listen->getBase() : bases_->allocBase(Ip4Addr(peer));
+        // the count of the base is updated when the connection is attached, it is approximate for a burst
+        if (maxConnsPerBase_ > 0 && b->connCount() >= maxConnsPerBase_) {
+            close(cfd);
+            stats_->rejected++;
             continue;
         }
-        r = util::addFdFlag(cfd, FD_CLOEXEC);
-        fatalif(r, "addFdFlag FD_CLOEXEC failed");
-        EventBase *b = bases_->allocBase();
+        stats_->conns++;
+        stats_->accepted++;
         auto addcon = [=] {
             TcpConnPtr con = createcb_();
-            con->attach(b, cfd, local, peer);
+            con->serverStats_ = stats_;
+            con->attach(b, cfd, local, peer, true);
             if (statecb_) {
                 con->onState(statecb_);
             }
@@ -330,18 +917,45 @@ void TcpServer::handleAccept() {
             if (msgcb_) {
                 con->onMsg(codec_->clone(), msgcb_);
             }
+            if (msgscb_) {
+                con->onMsgs(codec_->clone(), msgscb_);
+            }
+            if (msgBinder_) {
+                msgBinder_(con);
+            }
         };
-        if (b == base_) {
+        if (b == listen->getBase()) {
             addcon();
         } else {
             b->safeCall(move(addcon));
         }
     }
-    if (lfd >= 0 && errno != EAGAIN && errno != EINTR) {
+    if (lfd >= 0 && (errno == EMFILE || errno == ENFILE)) {
+        // the pending connection keeps the listener readable, reject it with the reserve fd instead of spinning
+        if (l.reserveFd >= 0) {
+            close(l.reserveFd);
+            cfd = accept(lfd, NULL, NULL);
+            if (cfd >= 0) {
+                close(cfd);
+                stats_->rejected++;
+            }
+            l.reserveFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        }
+        pauseAccept(index);
+    } else if (lfd >= 0 && errno != EAGAIN && errno != EINTR) {
         warn("accept return %d  %d %s", cfd, errno, strerror(errno));
     }
 }
 
+void TcpServer::pauseAccept(int index) {
+    Listener &l = listeners_[index];
+    l.backoff = std::min(l.backoff ? l.backoff * 2 : 10, 1000);
+    stats_->paused++;
+    warn("out of file descriptors, pause accepting on fd %d for %d ms", l.channel->fd(), l.backoff);
+    l.channel->enableRead(false);
+    l.resume = l.channel->getBase()->runAfter(l.backoff, [this, index] { listeners_[index].channel->enableRead(true); });
+}
+
 HSHAPtr HSHA::startServer(EventBase *base, const std::string &host, unsigned short port, int threads) {
     HSHAPtr p = HSHAPtr(new HSHA(threads));
     p->server_ = TcpServer::startServer(base, host, port);
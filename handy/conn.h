@@ -1,8 +1,34 @@
 #pragma once
+#include <sys/uio.h>
+#include <deque>
+#include "chain_buffer.h"
 #include "event_base.h"
+#include "frame_codec.h"
+#include "timer_wheel.h"
 
 namespace handy {
 
+//空闲回调的节点，嵌入在TcpConn中，直接挂在事件派发器的空闲时间轮上
+//读到数据时只更新updated_，节点到期时再检查是否真正空闲，未空闲则按updated_重新放入时间轮
+struct IdleNode : TimerNode {
+    IdleNode() : con_(NULL), idle_(0), updated_(0) {}
+    TcpConn *con_;
+    int64_t idle_;     //空闲时间，毫秒
+    int64_t updated_;  //最近一次活动的时间，毫秒
+    TcpCallBack cb_;
+    std::unique_ptr<IdleNode> next_;  //同一连接上的其他空闲回调
+};
+
+// TcpServer的连接统计，计数器可以在其他线程中读取
+struct TcpServerStats {
+    std::atomic<int64_t> conns;     //当前的连接数
+    std::atomic<int64_t> accepted;  //接受的连接数
+    std::atomic<int64_t> rejected;  //因为连接数超限或者fd耗尽而关闭的连接数
+    std::atomic<int64_t> paused;    // fd耗尽时暂停accept的次数
+    TcpServerStats() : conns(0), accepted(0), rejected(0), paused(0) {}
+};
+typedef std::shared_ptr<TcpServerStats> TcpServerStatsPtr;
+
 // Tcp连接，使用引用计数
 struct TcpConn : public std::enable_shared_from_this<TcpConn>, private noncopyable {
     // Tcp连接的个状态
@@ -46,12 +72,14 @@ struct TcpConn : public std::enable_shared_from_this<TcpConn>, private noncopyab
     Channel *getChannel() { return channel_; }
     bool writable() { return channel_ ? channel_->writeEnabled() : false; }
 
-    //发送数据
+    //发送数据。前面的数据尚未发送完时，较大的Buffer会整块移入输出队列而不复制，发送时通过writev一次写出多块
     void sendOutput() { send(output_); }
     void send(Buffer &msg);
     void send(const char *buf, size_t len);
     void send(const std::string &s) { send(s.data(), s.size()); }
     void send(const char *s) { send(s, strlen(s)); }
+    //发送ChainBuffer，未发送完的块共享后放入输出队列，不复制
+    void send(const ChainBuffer &buf);
 
     //数据到达时回调
     void onRead(const TcpCallBack &cb) {
@@ -60,16 +88,59 @@ struct TcpConn : public std::enable_shared_from_this<TcpConn>, private noncopyab
     };
     //当tcp缓冲区可写时回调
     void onWritable(const TcpCallBack &cb) { writablecb_ = cb; }
+    //输出水位。待发送的数据超过high时回调highcb，之后降到low及以下时回调lowcb，回调可以为空
+    // pauseRead为true时，超过high后暂停读取本连接，降到low及以下后恢复，慢速的对端不会让输出无限增长
+    void setWatermark(size_t high, size_t low, bool pauseRead = true, const TcpCallBack &highcb = nullptr, const TcpCallBack &lowcb = nullptr);
+    //暂停或恢复读取。代理时可以在一个连接的水位回调中暂停另一个连接的读取
+    void pauseRead(bool pause);
+    bool readPaused() { return readPaused_; }
+    //待发送的字节数
+    size_t outputSize() { return outqSize_ + output_.size(); }
     // tcp状态改变时回调
     void onState(const TcpCallBack &cb) { statecb_ = cb; }
-    // tcp空闲回调
-    void addIdleCB(int idle, const TcpCallBack &cb);
+    // tcp空闲回调，idle为秒数，连接在idle秒内没有读到数据时回调，之后每空闲idle秒回调一次
+    void addIdleCB(int idle, const TcpCallBack &cb) { addIdleCBMilli(idle * 1000LL, cb); }
+    //同addIdleCB，空闲时间为毫秒数
+    void addIdleCBMilli(int64_t milli, const TcpCallBack &cb);
 
     //消息回调，此回调与onRead回调冲突，只能够调用一个
     // codec所有权交给onMsg
     void onMsg(CodecBase *codec, const MsgCallBack &cb);
-    //发送消息
+    //批量的消息回调，一次读取中解析出的所有消息通过一次回调交给cb，之后一次性从输入缓冲区中移除
+    // msgs指向输入缓冲区，回调返回后失效。与onRead、onMsg回调冲突，只能够调用一个
+    void onMsgs(CodecBase *codec, const MsgsCallBack &cb);
+    //编译期codec的消息回调，如FrameCodec。解码时直接调用codec，不经过虚函数
+    // codec的副本保存在CodecAdaptor中，解码与sendMsg共用，连接重建时与onMsg(CodecBase*)一样被reset
+    template <class C, class = typename std::enable_if<!std::is_pointer<C>::value>::type>
+    void onMsg(const C &codec, const MsgCallBack &cb) {
+        assert(!readcb_);
+        CodecAdaptor<C> *adaptor = new CodecAdaptor<C>(codec);
+        codec_.reset(adaptor);
+        // the adaptor is owned by this connection and outlives readcb_
+        C *decoder = &adaptor->codec_;
+        onRead([decoder, cb](const TcpConnPtr &con) {
+            int r = 1;
+            while (r) {
+                Slice msg;
+                r = decoder->tryDecode(con->getInput(), msg);
+                if (r < 0) {
+                    con->channel_->close();
+                    break;
+                } else if (r > 0) {
+                    cb(con, msg);
+                    // closed by cb, the input is handled again from cleanup and this closure is destroyed
+                    if (!con->channel_) {
+                        break;
+                    }
+                    con->getInput().consume(r);
+                }
+            }
+        });
+    }
+    //发送消息。codec支持encodeFrame时，帧头、消息与帧尾通过writev直接发送，只复制未发送完的部分
     void sendMsg(Slice msg);
+    //发送消息，msg中的数据被移走，未发送完时msg不复制，直接放入输出队列
+    void sendMsg(Buffer &msg);
 
     // conn会在下个事件周期进行处理
     void close();
@@ -91,23 +162,66 @@ struct TcpConn : public std::enable_shared_from_this<TcpConn>, private noncopyab
     Buffer input_, output_;
     Ip4Addr local_, peer_;
     State state_;
-    TcpCallBack readcb_, writablecb_, statecb_;
-    std::list<IdleId> idleIds_;
+    TcpCallBack readcb_, writablecb_, statecb_, highcb_, lowcb_;
+    size_t highWater_, lowWater_;
+    bool pauseOnHigh_, aboveHigh_, readPaused_;
+    size_t readAvg_;  //每次读事件读到字节数的指数移动平均，用于调整输入缓冲区的大小
+    //输出队列中的一块数据，owner持有data所在的内存
+    struct OutputBlock {
+        std::shared_ptr<void> owner;
+        Slice data;
+    };
+    //待发送的数据依次为outq_中的各块与output_
+    std::deque<OutputBlock> outq_;
+    size_t outqSize_;  // outq_中的字节数
+    // uring_为true时读写作为io_uring请求提交，见PollerType::IoUringCompletion。reading_、writing_表示有请求未完成
+    bool uring_, reading_, writing_;
+    std::shared_ptr<Buffer> readBlock_;  // io_uring读请求写入的缓冲区，完成后移入input_
+    std::shared_ptr<std::vector<std::shared_ptr<void>>> writeBlocks_;  // io_uring写请求引用的输出块
+    IdleNode idle_;
+    TcpServerStatsPtr serverStats_;  //由TcpServer接受的连接，关闭时减少服务器的连接数
     TimerId timeoutId_;
     AutoContext ctx_, internalCtx_;
     std::string destHost_, localIp_;
     int destPort_, connectTimeout_, reconnectInterval_;
     int64_t connectedTime_;
     std::unique_ptr<CodecBase> codec_;
+    std::vector<Slice> msgs_;  // onMsgs解析消息时复用的数组
     void handleRead(const TcpConnPtr &con);
     void handleWrite(const TcpConnPtr &con);
     ssize_t isend(const char *buf, size_t len);
+    //写出iov中的数据，直到全部写完或者遇到EAGAIN，返回写出的字节数
+    ssize_t isendv(struct iovec *iov, int cnt);
+    //通过writev写出outq_与output_中的数据
+    void flushOutput();
+    //把buf放到待发送数据的末尾
+    void queueOutput(Buffer &buf);
+    void pushOutput(const std::shared_ptr<void> &owner, Slice data);
+    //提交io_uring读写请求，已有未完成的请求时不提交
+    void startRead();
+    void startWrite();
+    //有待发送的数据时，开始写或者等待可写
+    void wantWrite();
+    void handleReadDone(const TcpConnPtr &con, int res);
+    void handleWriteDone(const TcpConnPtr &con, int res);
+    //根据待发送的字节数触发水位回调
+    void checkWatermark();
+    //按本次读事件读到的字节数更新readAvg_，释放输入缓冲区多余的内存
+    void adaptInput(size_t readed);
     void cleanup(const TcpConnPtr &con);
     void connect(EventBase *base, const std::string &host, unsigned short port, int timeout, const std::string &localip);
     void reconnect();
-    void attach(EventBase *base, int fd, Ip4Addr local, Ip4Addr peer);
+    // nonBlocking为true表示fd已经是非阻塞的
+    void attach(EventBase *base, int fd, Ip4Addr local, Ip4Addr peer, bool nonBlocking = false);
+    // readImp/writeImp是否直接读写socket。重写了readImp/writeImp的子类，如SSLConn，需要返回false，
+    //此时readv/writev逐块经过readImp/writeImp，连接也不使用io_uring的完成模式
+    virtual bool rawSocketIo() { return true; }
     virtual int readImp(int fd, void *buf, size_t bytes) { return ::read(fd, buf, bytes); }
+    // rawSocketIo为true时直接调用readv，否则先通过readImp读入iov[0]，填满后再读入后面的块
+    virtual int readvImp(int fd, const struct iovec *iov, int cnt);
     virtual int writeImp(int fd, const void *buf, size_t bytes) { return ::write(fd, buf, bytes); }
+    // rawSocketIo为true时直接调用writev，否则逐块调用writeImp
+    virtual int writevImp(int fd, const struct iovec *iov, int cnt);
     virtual int handleHandshake(const TcpConnPtr &con);
 };
 
@@ -115,16 +229,28 @@ struct TcpConn : public std::enable_shared_from_this<TcpConn>, private noncopyab
 struct TcpServer : private noncopyable {
     TcpServer(EventBases *bases);
     // return 0 on sucess, errno on error
-    int bind(const std::string &host, unsigned short port, bool reusePort = false);
-    static TcpServerPtr startServer(EventBases *bases, const std::string &host, unsigned short port, bool reusePort = false);
-    ~TcpServer() { delete listen_channel_; }
+    // acceptPerLoop为true时，bases中的每个事件派发器都使用SO_REUSEPORT打开一个监听socket，由内核分配连接，
+    // 连接在接受它的事件派发器上处理，不再通过safeCall转交给其他线程
+    int bind(const std::string &host, unsigned short port, bool reusePort = false, bool acceptPerLoop = false);
+    static TcpServerPtr startServer(EventBases *bases, const std::string &host, unsigned short port, bool reusePort = false, bool acceptPerLoop = false);
+    ~TcpServer();
+    // listen的backlog，默认为SOMAXCONN，需要在bind之前设置
+    void setBacklog(int backlog) { backlog_ = backlog; }
+    //设置TCP_DEFER_ACCEPT，连接上有数据到达后才accept，最多等待seconds秒。仅linux有效，需要在bind之前设置
+    void setDeferAccept(int seconds) { deferAccept_ = seconds; }
+    //服务器的最大连接数，超过后新接受的连接会被立即关闭。0为不限制
+    void setMaxConns(int maxConns) { maxConns_ = maxConns; }
+    //每个事件派发器上的最大连接数，分配到的事件派发器已满时新连接被立即关闭。0为不限制
+    void setMaxConnsPerBase(int maxConns) { maxConnsPerBase_ = maxConns; }
+    //连接统计，可以通过StatServer::onServerStats展示
+    TcpServerStatsPtr getStats() { return stats_; }
     Ip4Addr getAddr() { return addr_; }
     EventBase *getBase() { return base_; }
     void onConnCreate(const std::function<TcpConnPtr()> &cb) { createcb_ = cb; }
     void onConnState(const TcpCallBack &cb) { statecb_ = cb; }
     void onConnRead(const TcpCallBack &cb) {
         readcb_ = cb;
-        assert(!msgcb_);
+        assert(!msgcb_ && !msgscb_ && !msgBinder_);
     }
     // 消息处理与Read回调冲突，只能调用一个
     void onConnMsg(CodecBase *codec, const MsgCallBack &cb) {
@@ -132,17 +258,47 @@ struct TcpServer : private noncopyable {
         msgcb_ = cb;
         assert(!readcb_);
     }
+    // 批量的消息处理，见TcpConn::onMsgs
+    void onConnMsgs(CodecBase *codec, const MsgsCallBack &cb) {
+        codec_.reset(codec);
+        msgscb_ = cb;
+        assert(!readcb_);
+    }
+    // 编译期codec的消息处理，见TcpConn::onMsg
+    template <class C, class = typename std::enable_if<!std::is_pointer<C>::value>::type>
+    void onConnMsg(const C &codec, const MsgCallBack &cb) {
+        msgBinder_ = [codec, cb](const TcpConnPtr &con) { con->onMsg(codec, cb); };
+        assert(!readcb_);
+    }
 
    private:
     EventBase *base_;
     EventBases *bases_;
     Ip4Addr addr_;
-    Channel *listen_channel_;
+    struct Listener {
+        Channel *channel;
+        //预留的fd，accept遇到EMFILE时关闭它，以便接受并关闭一个连接
+        int reserveFd;
+        //暂停accept的时间，毫秒，连续暂停时加倍
+        int backoff;
+        TimerId resume;
+    };
+    std::vector<Listener> listeners_;
+    bool acceptPerLoop_;
+    //绑定在具体ip上时，所有连接的本地地址都是addr_，不需要对每个连接调用getsockname
+    bool localFixed_;
+    int backlog_, deferAccept_;
+    int maxConns_, maxConnsPerBase_;
+    TcpServerStatsPtr stats_;
     TcpCallBack statecb_, readcb_;
     MsgCallBack msgcb_;
+    MsgsCallBack msgscb_;
+    TcpCallBack msgBinder_;  //为新连接设置编译期codec的消息回调
     std::function<TcpConnPtr()> createcb_;
     std::unique_ptr<CodecBase> codec_;
-    void handleAccept();
+    void handleAccept(int index);
+    void pauseAccept(int index);
+    void closeListeners();
 };
 
 typedef std::function<std::string(const TcpConnPtr &, const std::string &msg)> RetMsgCallBack;
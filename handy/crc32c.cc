@@ -0,0 +1,160 @@
+#include "crc32c.h"
+#include <string.h>
+
+namespace handy {
+
+namespace {
+
+// slicing-by-8 tables for the reflected polynomial 0x82F63B78
+struct Crc32cTable {
+    uint32_t t[8][256];
+    Crc32cTable() {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = c & 1 ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+            }
+            t[0][i] = c;
+        }
+        for (uint32_t i = 0; i < 256; i++) {
+            for (int k = 1; k < 8; k++) {
+                t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff];
+            }
+        }
+    }
+};
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+
+// crc32 has a latency of 3 cycles and a throughput of 1, so three independent streams are computed
+// over adjacent blocks and combined afterwards: appending n zero bytes to a crc is a linear map,
+// kept as 4 byte-indexed tables for each block size
+struct Crc32cZeros {
+    uint32_t t[4][256];
+    explicit Crc32cZeros(size_t len) {
+        uint32_t op[32];
+        zerosOp(op, len);
+        for (uint32_t n = 0; n < 256; n++) {
+            t[0][n] = times(op, n);
+            t[1][n] = times(op, n << 8);
+            t[2][n] = times(op, n << 16);
+            t[3][n] = times(op, n << 24);
+        }
+    }
+    uint32_t shift(uint32_t crc) const { return t[0][crc & 0xff] ^ t[1][(crc >> 8) & 0xff] ^ t[2][(crc >> 16) & 0xff] ^ t[3][crc >> 24]; }
+    static uint32_t times(const uint32_t *mat, uint32_t vec) {
+        uint32_t sum = 0;
+        for (; vec; vec >>= 1, mat++) {
+            if (vec & 1) {
+                sum ^= *mat;
+            }
+        }
+        return sum;
+    }
+    static void square(uint32_t *sq, const uint32_t *mat) {
+        for (int n = 0; n < 32; n++) {
+            sq[n] = times(mat, mat[n]);
+        }
+    }
+    // the operator appending len zero bytes, len is a power of two
+    static void zerosOp(uint32_t *even, size_t len) {
+        uint32_t odd[32];
+        odd[0] = 0x82F63B78;
+        for (int n = 1; n < 32; n++) {
+            odd[n] = 1u << (n - 1);
+        }
+        square(even, odd);  // 2 zero bits
+        square(odd, even);  // 4 zero bits
+        for (;;) {
+            square(even, odd);
+            len >>= 1;
+            if (len == 0) {
+                return;
+            }
+            square(odd, even);
+            len >>= 1;
+            if (len == 0) {
+                memcpy(even, odd, sizeof odd);
+                return;
+            }
+        }
+    }
+};
+
+const size_t kLongBlock = 4096, kShortBlock = 256;
+
+__attribute__((target("sse4.2"))) uint64_t crc32cStreams(uint64_t c0, const char *&data, size_t &len, size_t block, const Crc32cZeros &zeros) {
+    while (len >= block * 3) {
+        uint64_t c1 = 0, c2 = 0;
+        for (const char *end = data + block; data < end; data += 8) {
+            uint64_t v0, v1, v2;
+            memcpy(&v0, data, 8);
+            memcpy(&v1, data + block, 8);
+            memcpy(&v2, data + block * 2, 8);
+            c0 = __builtin_ia32_crc32di(c0, v0);
+            c1 = __builtin_ia32_crc32di(c1, v1);
+            c2 = __builtin_ia32_crc32di(c2, v2);
+        }
+        c0 = zeros.shift((uint32_t) c0) ^ c1;
+        c0 = zeros.shift((uint32_t) c0) ^ c2;
+        data += block * 2;
+        len -= block * 3;
+    }
+    return c0;
+}
+
+__attribute__((target("sse4.2"))) uint32_t crc32cHardware(uint32_t crc, const char *data, size_t len) {
+    static const Crc32cZeros longZeros(kLongBlock), shortZeros(kShortBlock);
+    uint64_t c = ~crc;
+    c = crc32cStreams(c, data, len, kLongBlock, longZeros);
+    c = crc32cStreams(c, data, len, kShortBlock, shortZeros);
+    for (; len >= 8; len -= 8, data += 8) {
+        uint64_t v;
+        memcpy(&v, data, 8);
+        c = __builtin_ia32_crc32di(c, v);
+    }
+    uint32_t c32 = (uint32_t) c;
+    for (; len; len--, data++) {
+        c32 = __builtin_ia32_crc32qi(c32, (unsigned char) *data);
+    }
+    return ~c32;
+}
+
+typedef uint32_t (*Crc32cFunc)(uint32_t, const char *, size_t);
+
+Crc32cFunc chooseCrc32c() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2") ? crc32cHardware : crc32cPortable;
+}
+
+#endif
+
+}  // namespace
+
+uint32_t crc32c(uint32_t crc, const char *data, size_t len) {
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    static const Crc32cFunc func = chooseCrc32c();
+    return func(crc, data, len);
+#else
+    return crc32cPortable(crc, data, len);
+#endif
+}
+
+uint32_t crc32cPortable(uint32_t crc, const char *data, size_t len) {
+    static const Crc32cTable table;
+    const uint32_t(*t)[256] = table.t;
+    const unsigned char *p = (const unsigned char *) data;
+    crc = ~crc;
+    for (; len >= 8; len -= 8, p += 8) {
+        uint32_t lo = crc ^ (uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16 | uint32_t(p[3]) << 24);
+        uint32_t hi = uint32_t(p[4]) | uint32_t(p[5]) << 8 | uint32_t(p[6]) << 16 | uint32_t(p[7]) << 24;
+        crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^ t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^
+              t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+    }
+    for (; len; len--, p++) {
+        crc = t[0][(crc ^ *p) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+}  // namespace handy
@@ -0,0 +1,13 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+namespace handy {
+
+// CRC32C(Castagnoli)校验，crc为前面数据的校验值，首段为0，可以分段计算：crc32c(crc32c(0, a), b)等于a与b连接后的校验值
+//支持SSE4.2的x86_64 cpu上使用crc32指令，其他情况使用软件实现
+uint32_t crc32c(uint32_t crc, const char *data, size_t len);
+//软件实现，结果与crc32c相同，用于测试与对比
+uint32_t crc32cPortable(uint32_t crc, const char *data, size_t len);
+
+}  // namespace handy
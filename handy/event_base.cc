@@ -1,10 +1,14 @@
 #include "event_base.h"
 #include <fcntl.h>
 #include <cstring>
+#ifdef OS_LINUX
+#include <sys/eventfd.h>
+#endif
 #include <map>
 #include "conn.h"
 #include "logging.h"
 #include "poller.h"
+#include "timer_wheel.h"
 #include "util.h"
 using namespace std;
 
@@ -12,55 +16,87 @@ namespace handy {
 
 namespace {
 
-struct TimerRepeatable {
-    int64_t at;  // current timer timeout timestamp
+struct TimerTask : public TimerNode {
     int64_t interval;
-    TimerId timerid;
+    uint32_t index;
+    uint32_t gen;  // changed every time the task is released, so stale TimerIds are detected
     Task cb;
 };
 
-struct IdleNode {
-    TcpConnPtr con_;
-    int64_t updated_;
-    TcpCallBack cb_;
+// TimerTasks are allocated in chunks and never moved, so they can be linked into the wheel directly
+struct TimerPool {
+    static const uint32_t kChunkSize = 1024;
+    std::vector<std::unique_ptr<TimerTask[]>> chunks_;
+    std::vector<uint32_t> free_;
+
+    TimerTask *alloc() {
+        if (free_.empty()) {
+            uint32_t base = chunks_.size() * kChunkSize;
+            chunks_.emplace_back(new TimerTask[kChunkSize]);
+            for (uint32_t i = 0; i < kChunkSize; i++) {
+                TimerTask &t = chunks_.back()[i];
+                t.index = base + i;
+                t.gen = 1;
+                free_.push_back(base + kChunkSize - 1 - i);
+            }
+        }
+        TimerTask *t = at(free_.back());
+        free_.pop_back();
+        return t;
+    }
+    void release(TimerTask *t) {
+        t->cb = nullptr;
+        t->interval = 0;
+        if (++t->gen == 0) {
+            t->gen = 1;
+        }
+        free_.push_back(t->index);
+    }
+    TimerTask *at(uint32_t index) { return &chunks_[index / kChunkSize][index % kChunkSize]; }
+    // return NULL if the timer id is expired or canceled
+    TimerTask *find(const TimerId &timerid) {
+        uint32_t index = (uint32_t) timerid.second;
+        uint32_t gen = (uint32_t)(timerid.second >> 32);
+        if (gen == 0 || index >= chunks_.size() * kChunkSize) {
+            return NULL;
+        }
+        TimerTask *t = at(index);
+        return t->gen == gen ? t : NULL;
+    }
+    static TimerId timerId(TimerTask *t, int64_t milli) { return TimerId{t->interval ? -milli : milli, (int64_t) t->gen << 32 | t->index}; }
 };
 
 }  // namespace
 
-struct IdleIdImp {
-    IdleIdImp() {}
-    typedef list<IdleNode>::iterator Iter;
-    IdleIdImp(list<IdleNode> *lst, Iter iter) : lst_(lst), iter_(iter) {}
-    list<IdleNode> *lst_;
-    Iter iter_;
-};
-
 struct EventsImp {
     EventBase *base_;
     PollerBase *poller_;
     std::atomic<bool> exit_;
+    // linux使用eventfd，wakeupFds_[0]与wakeupFds_[1]相同；其他平台使用pipe
     int wakeupFds_[2];
-    int nextTimeout_;
-    SafeQueue<Task> tasks_;
-
-    std::map<TimerId, TimerRepeatable> timerReps_;
-    std::map<TimerId, Task> timers_;
-    std::atomic<int64_t> timerSeq_;
-    // 记录每个idle时间（单位秒）下所有的连接。链表中的所有连接，最新的插入到链表末尾。连接若有活动，会把连接从链表中移到链表尾部，做法参考memcache
-    std::map<int, std::list<IdleNode>> idleConns_;
-    std::set<TcpConnPtr> reconnectConns_;
-    bool idleEnabled;
+    std::atomic<bool> wakeupPending_;
+    MpscQueue<Task> tasks_;
 
-    EventsImp(EventBase *base, int taskCap);
+    TimerWheel timers_;
+    TimerPool timerPool_;
+    // 空闲回调的时间轮，节点嵌入在TcpConn中
+    TimerWheel idles_;
+    std::set<TcpConnPtr> reconnectConns_;
+    bool edgeTriggered_;
+    size_t readBudget_;
+    // load counters read by MultiBase from other threads
+    std::atomic<int> conns_;
+    std::atomic<int64_t> busyMicro_, busyStart_;
+    std::atomic<bool> polling_;
+    int64_t busyAcc_;
+
+    EventsImp(EventBase *base, int taskCap, PollerType poller);
     ~EventsImp();
     void init();
-    void callIdles();
-    IdleId registerIdle(int idle, const TcpConnPtr &con, const TcpCallBack &cb);
-    void unregisterIdle(const IdleId &id);
-    void updateIdle(const IdleId &id);
+    void handleIdles();
     void handleTimeouts();
-    void refreshNearest(const TimerId *tid = NULL);
-    void repeatableTimeout(TimerRepeatable *tr);
+    void updateBusy();
+    void clearTimers();
 
     // eventbase functions
     EventBase &exit() {
@@ -75,11 +111,29 @@ struct EventsImp {
     }
     void loop();
     void loop_once(int waitMs) {
-        poller_->loop_once(std::min(waitMs, nextTimeout_));
+        // the callbacks since the last poll may have run for a while, timers due meanwhile must not wait
+        int64_t wait = std::min(timers_.nearest(), idles_.nearest()) - base_->preciseNow();
+        if (poller_->trackBusy_) {
+            updateBusy();
+        }
+        polling_ = true;
+        poller_->loop_once(wait < 0 ? 0 : (int) std::min<int64_t>(waitMs, wait));
+        polling_ = false;
+        // expire against the time after the I/O callbacks, runAfter(0) from a callback fires in this iteration
+        base_->preciseNow();
         handleTimeouts();
     }
     void wakeup() {
+        // a pending wakeup will handle all tasks pushed before it is consumed
+        if (wakeupPending_.exchange(true)) {
+            return;
+        }
+#ifdef OS_LINUX
+        uint64_t v = 1;
+        int r = write(wakeupFds_[1], &v, sizeof v);
+#else
         int r = write(wakeupFds_[1], "", 1);
+#endif
         fatalif(r <= 0, "write error wd %d %d %s", r, errno, strerror(errno));
     }
 
@@ -87,8 +141,8 @@ struct EventsImp {
     TimerId runAt(int64_t milli, Task &&task, int64_t interval);
 };
 
-EventBase::EventBase(int taskCapacity) {
-    imp_.reset(new EventsImp(this, taskCapacity));
+EventBase::EventBase(int taskCapacity, PollerType poller) {
+    imp_.reset(new EventsImp(this, taskCapacity, poller));
     imp_->init();
 }
 
@@ -106,6 +160,51 @@ void EventBase::safeCall(Task &&task) {
     imp_->safeCall(move(task));
 }
 
+size_t EventBase::taskSize() {
+    return imp_->tasks_.size();
+}
+
+void EventBase::setEdgeTriggered(bool et) {
+    imp_->edgeTriggered_ = et;
+}
+
+bool EventBase::edgeTriggered() {
+    return imp_->edgeTriggered_;
+}
+
+void EventBase::setReadBudget(size_t bytes) {
+    imp_->readBudget_ = bytes;
+}
+
+size_t EventBase::readBudget() {
+    return imp_->readBudget_;
+}
+
+int64_t EventBase::now() {
+    return imp_->poller_->now_;
+}
+
+int64_t EventBase::preciseNow() {
+    return imp_->poller_->now_ = util::timeMilli();
+}
+
+void EventBase::trackBusy(bool track) {
+    imp_->poller_->trackBusy_ = track;
+}
+
+int EventBase::connCount() {
+    return imp_->conns_;
+}
+
+int64_t EventBase::busyMicro() {
+    // the busy time is published once per second by the loop itself, a stale value means the loop
+    // is either sleeping in poll, or stuck in a callback
+    if (util::steadyMicro() - imp_->busyStart_ > 2000000) {
+        return imp_->polling_ ? 0 : 1000000;
+    }
+    return imp_->busyMicro_;
+}
+
 void EventBase::wakeup() {
     imp_->wakeup();
 }
@@ -126,15 +225,13 @@ TimerId EventBase::runAt(int64_t milli, Task &&task, int64_t interval) {
     return imp_->runAt(milli, std::move(task), interval);
 }
 
-EventsImp::EventsImp(EventBase *base, int taskCap)
-    : base_(base), poller_(createPoller()), exit_(false), nextTimeout_(1 << 30), tasks_(taskCap), timerSeq_(0), idleEnabled(false) {}
+EventsImp::EventsImp(EventBase *base, int taskCap, PollerType poller)
+    : base_(base), poller_(createPoller(poller)), exit_(false), wakeupPending_(false), tasks_(taskCap), timers_(util::timeMilli()), idles_(util::timeMilli()), edgeTriggered_(false), readBudget_(0), conns_(0), busyMicro_(0), busyStart_(util::steadyMicro()), polling_(false), busyAcc_(0) {}
 
 void EventsImp::loop() {
     while (!exit_)
         loop_once(10000);
-    timerReps_.clear();
-    timers_.clear();
-    idleConns_.clear();
+    clearTimers();
     for (auto recon : reconnectConns_) {  //重连的连接无法通过channel清理，因此单独清理
         recon->cleanup(recon);
     }
@@ -142,6 +239,11 @@ void EventsImp::loop() {
 }
 
 void EventsImp::init() {
+#ifdef OS_LINUX
+    wakeupFds_[0] = wakeupFds_[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    fatalif(wakeupFds_[0] < 0, "eventfd failed %d %s", errno, strerror(errno));
+    trace("wakeup eventfd created %d", wakeupFds_[0]);
+#else
     int r = pipe(wakeupFds_);
     fatalif(r, "pipe failed %d %s", errno, strerror(errno));
     r = util::addFdFlag(wakeupFds_[0], FD_CLOEXEC);
@@ -149,18 +251,18 @@ void EventsImp::init() {
     r = util::addFdFlag(wakeupFds_[1], FD_CLOEXEC);
     fatalif(r, "addFdFlag failed %d %s", errno, strerror(errno));
     trace("wakeup pipe created %d %d", wakeupFds_[0], wakeupFds_[1]);
+#endif
     Channel *ch = new Channel(base_, wakeupFds_[0], kReadEvent);
     ch->onRead([=] {
         char buf[1024];
         int r = ch->fd() >= 0 ? ::read(ch->fd(), buf, sizeof buf) : 0;
+        // clear the flag after the read and before draining, so tasks pushed from now on will wake us again
+        wakeupPending_ = false;
         if (r > 0) {
-            Task task;
-            while (tasks_.pop_wait(&task, 0)) {
-                task();
-            }
+            tasks_.popAll([](Task &&task) { task(); });
         } else if (r == 0) {
             delete ch;
-        } else if (errno == EINTR) {
+        } else if (errno == EINTR || errno == EAGAIN) {
         } else {
             fatal("wakeup channel read error %d %d %s", r, errno, strerror(errno));
         }
@@ -168,132 +270,160 @@ void EventsImp::init() {
 }
 
 void EventsImp::handleTimeouts() {
-    int64_t now = util::timeMilli();
-    TimerId tid{now, 1L << 62};
-    while (timers_.size() && timers_.begin()->first < tid) {
-        Task task = move(timers_.begin()->second);
-        timers_.erase(timers_.begin());
-        task();
-    }
-    refreshNearest();
-}
-
-EventsImp::~EventsImp() {
-    delete poller_;
-    ::close(wakeupFds_[1]);
-}
-
-void EventsImp::callIdles() {
-    int64_t now = util::timeMilli() / 1000;
-    for (auto &l : idleConns_) {
-        int idle = l.first;
-        auto& lst = l.second;
-        while (lst.size()) {
-            IdleNode &node = lst.front();
-            if (node.updated_ + idle > now) {
-                break;
+    timers_.expire(poller_->now_);
+    while (TimerNode *node = timers_.popExpired()) {
+        TimerTask *t = static_cast<TimerTask *>(node);
+        // the callback may cancel its own timer, so run a moved copy of it
+        Task cb = move(t->cb);
+        if (t->interval) {
+            uint32_t gen = t->gen;
+            timers_.add(t, t->at() + t->interval);
+            cb();
+            if (t->gen == gen) {
+                t->cb = move(cb);
             }
-            node.updated_ = now;
-            lst.splice(lst.end(), lst, lst.begin());
-            node.cb_(node.con_);
+        } else {
+            timerPool_.release(t);
+            cb();
+        }
+    }
+    timers_.refreshNearest();
+    handleIdles();
+}
+
+void EventsImp::handleIdles() {
+    int64_t now = poller_->now_;
+    idles_.expire(now);
+    while (TimerNode *n = idles_.popExpired()) {
+        IdleNode *node = static_cast<IdleNode *>(n);
+        if (node->updated_ + node->idle_ > now) {
+            // the connection was active after the node was scheduled
+            idles_.add(node, node->updated_ + node->idle_);
+            continue;
+        }
+        node->updated_ = now;
+        idles_.add(node, now + node->idle_);
+        // the callback may close the connection and unregister the node, so run a moved copy of it
+        TcpConnPtr con = node->con_->shared_from_this();
+        TcpCallBack cb = move(node->cb_);
+        cb(con);
+        if (node->linked()) {
+            node->cb_ = move(cb);
         }
     }
+    idles_.refreshNearest();
 }
 
-IdleId EventsImp::registerIdle(int idle, const TcpConnPtr &con, const TcpCallBack &cb) {
-    if (!idleEnabled) {
-        base_->runAfter(1000, [this] { callIdles(); }, 1000);
-        idleEnabled = true;
+void EventsImp::updateBusy() {
+    // the loop is busy from the return of poll to the next poll
+    int64_t t = util::steadyMicro();
+    if (poller_->awake_) {
+        busyAcc_ += t - poller_->awake_;
+        poller_->awake_ = 0;
+    }
+    int64_t start = busyStart_;
+    if (t - start >= 1000000) {
+        busyMicro_ = busyAcc_ * 1000000 / (t - start);
+        busyAcc_ = 0;
+        busyStart_ = t;
     }
-    auto &lst = idleConns_[idle];
-    lst.push_back(IdleNode{con, util::timeMilli() / 1000, move(cb)});
-    trace("register idle");
-    return IdleId(new IdleIdImp(&lst, --lst.end()));
 }
 
-void EventsImp::unregisterIdle(const IdleId &id) {
-    trace("unregister idle");
-    id->lst_->erase(id->iter_);
+void EventsImp::clearTimers() {
+    for (size_t i = 0; i < timerPool_.chunks_.size() * TimerPool::kChunkSize; i++) {
+        TimerTask *t = timerPool_.at(i);
+        if (t->linked()) {
+            timers_.remove(t);
+            timerPool_.release(t);
+        }
+    }
 }
 
-void EventsImp::updateIdle(const IdleId &id) {
-    trace("update idle");
-    id->iter_->updated_ = util::timeMilli() / 1000;
-    id->lst_->splice(id->lst_->end(), *id->lst_, id->iter_);
+EventsImp::~EventsImp() {
+    delete poller_;
+    if (wakeupFds_[1] != wakeupFds_[0]) {
+        ::close(wakeupFds_[1]);
+    }
 }
 
-void EventsImp::refreshNearest(const TimerId *tid) {
-    if (timers_.empty()) {
-        nextTimeout_ = 1 << 30;
-    } else {
-        const TimerId &t = timers_.begin()->first;
-        nextTimeout_ = t.first - util::timeMilli();
-        nextTimeout_ = nextTimeout_ < 0 ? 0 : nextTimeout_;
+TimerId EventsImp::runAt(int64_t milli, Task &&task, int64_t interval) {
+    if (exit_) {
+        return TimerId();
     }
+    TimerTask *t = timerPool_.alloc();
+    t->interval = interval;
+    t->cb = move(task);
+    timers_.add(t, milli);
+    return TimerPool::timerId(t, milli);
 }
 
-void EventsImp::repeatableTimeout(TimerRepeatable *tr) {
-    tr->at += tr->interval;
-    tr->timerid = {tr->at, ++timerSeq_};
-    timers_[tr->timerid] = [this, tr] { repeatableTimeout(tr); };
-    refreshNearest(&tr->timerid);
-    tr->cb();
+bool EventsImp::cancel(TimerId timerid) {
+    TimerTask *t = timerPool_.find(timerid);
+    if (t == NULL) {
+        return false;
+    }
+    timers_.remove(t);
+    timerPool_.release(t);
+    return true;
 }
 
-TimerId EventsImp::runAt(int64_t milli, Task &&task, int64_t interval) {
-    if (exit_) {
-        return TimerId();
+void MultiBase::setPolicy(BasePolicy policy) {
+    policy_ = policy;
+    for (auto &b : bases_) {
+        b->trackBusy(policy == BasePolicy::LeastBusy);
     }
-    if (interval) {
-        TimerId tid{-milli, ++timerSeq_};
-        TimerRepeatable &rtr = timerReps_[tid];
-        rtr = {milli, interval, {milli, ++timerSeq_}, move(task)};
-        TimerRepeatable *tr = &rtr;
-        timers_[tr->timerid] = [this, tr] { repeatableTimeout(tr); };
-        refreshNearest(&tr->timerid);
-        return tid;
-    } else {
-        TimerId tid{milli, ++timerSeq_};
-        timers_.insert({tid, move(task)});
-        refreshNearest(&tid);
-        return tid;
+}
+
+EventBase *MultiBase::allocBase() {
+    if (policy_ == BasePolicy::LeastConns || policy_ == BasePolicy::LeastBusy) {
+        return leastLoaded();
     }
+    unsigned c = id_++;
+    return bases_[c % bases_.size()].get();
 }
 
-bool EventsImp::cancel(TimerId timerid) {
-    if (timerid.first < 0) {
-        auto p = timerReps_.find(timerid);
-        auto ptimer = timers_.find(p->second.timerid);
-        if (ptimer != timers_.end()) {
-            timers_.erase(ptimer);
-        }
-        timerReps_.erase(p);
-        return true;
-    } else {
-        auto p = timers_.find(timerid);
-        if (p != timers_.end()) {
-            timers_.erase(p);
-            return true;
+EventBase *MultiBase::allocBase(const Ip4Addr &peer) {
+    if (policy_ != BasePolicy::PeerHash) {
+        return allocBase();
+    }
+    // multiplicative hashing spreads consecutive addresses, the high bits pick the base
+    uint32_t h = peer.ipInt() * 2654435761u;
+    return bases_[(uint64_t) h * bases_.size() >> 32].get();
+}
+
+EventBase *MultiBase::leastLoaded() {
+    // scan from a rotating start, so ties are broken in round robin
+    size_t n = bases_.size();
+    unsigned start = id_++;
+    EventBase *best = NULL;
+    int64_t bestLoad = 0;
+    for (size_t i = 0; i < n; i++) {
+        EventBase *b = bases_[(start + i) % n].get();
+        int64_t load = policy_ == BasePolicy::LeastConns ? b->connCount() : b->busyMicro();
+        if (best == NULL || load < bestLoad) {
+            best = b;
+            bestLoad = load;
         }
-        return false;
     }
+    return best;
 }
 
 void MultiBase::loop() {
     int sz = bases_.size();
     vector<thread> ths(sz - 1);
     for (int i = 0; i < sz - 1; i++) {
-        thread t([this, i] { bases_[i].loop(); });
+        thread t([this, i] { bases_[i]->loop(); });
         ths[i].swap(t);
     }
-    bases_.back().loop();
+    bases_.back()->loop();
     for (int i = 0; i < sz - 1; i++) {
         ths[i].join();
     }
 }
 
-Channel::Channel(EventBase *base, int fd, int events) : base_(base), fd_(fd), events_(events) {
-    fatalif(net::setNonBlock(fd_) < 0, "channel set non block failed");
+Channel::Channel(EventBase *base, int fd, int events, bool edgeTriggered, bool nonBlocking)
+    : base_(base), fd_(fd), events_(events), edgeTriggered_(edgeTriggered) {
+    fatalif(!nonBlocking && net::setNonBlock(fd_) < 0, "channel set non block failed");
     static atomic<int64_t> id(0);
     id_ = ++id;
     poller_ = base_->imp_->poller_;
@@ -353,25 +483,64 @@ bool Channel::writeEnabled() {
     return events_ & kWriteEvent;
 }
 
-void handyUnregisterIdle(EventBase *base, const IdleId &idle) {
-    base->imp_->unregisterIdle(idle);
+void handyConnCount(EventBase *base, int delta) {
+    base->imp_->conns_ += delta;
 }
 
-void handyUpdateIdle(EventBase *base, const IdleId &idle) {
-    base->imp_->updateIdle(idle);
+void handyUnregisterIdle(EventBase *base, IdleNode *node) {
+    base->imp_->idles_.remove(node);
+    node->cb_ = nullptr;
 }
 
 TcpConn::TcpConn()
-    : base_(NULL), channel_(NULL), state_(State::Invalid), destPort_(-1), connectTimeout_(0), reconnectInterval_(-1), connectedTime_(util::timeMilli()) {}
+    : base_(NULL),
+      channel_(NULL),
+      state_(State::Invalid),
+      highWater_(0),
+      lowWater_(0),
+      pauseOnHigh_(false),
+      aboveHigh_(false),
+      readPaused_(false),
+      readAvg_(0),
+      outqSize_(0),
+      uring_(false),
+      reading_(false),
+      writing_(false),
+      destPort_(-1),
+      connectTimeout_(0),
+      reconnectInterval_(-1),
+      connectedTime_(util::timeMilli()) {}
 
 TcpConn::~TcpConn() {
     trace("tcp destroyed %s - %s", local_.toString().c_str(), peer_.toString().c_str());
+    if (channel_) {
+        // not closed through cleanup, the wheel must not keep the embedded nodes
+        for (IdleNode *node = &idle_; node; node = node->next_.get()) {
+            handyUnregisterIdle(channel_->getBase(), node);
+        }
+        handyConnCount(channel_->getBase(), -1);
+    }
+    if (serverStats_) {
+        serverStats_->conns--;
+    }
     delete channel_;
 }
 
-void TcpConn::addIdleCB(int idle, const TcpCallBack &cb) {
+void TcpConn::addIdleCBMilli(int64_t milli, const TcpCallBack &cb) {
     if (channel_) {
-        idleIds_.push_back(getBase()->imp_->registerIdle(idle, shared_from_this(), cb));
+        IdleNode *node = &idle_;
+        while (node->linked()) {
+            if (!node->next_) {
+                node->next_.reset(new IdleNode);
+            }
+            node = node->next_.get();
+        }
+        node->con_ = this;
+        node->idle_ = milli;
+        node->updated_ = getBase()->now();
+        node->cb_ = cb;
+        getBase()->imp_->idles_.add(node, node->updated_ + node->idle_);
+        trace("register idle %ld ms", (long) milli);
     }
 }
 
@@ -385,6 +554,7 @@ void TcpConn::reconnect() {
         getBase()->imp_->reconnectConns_.erase(con);
         connect(getBase(), destHost_, (unsigned short) destPort_, connectTimeout_, localIp_);
     });
+    handyConnCount(channel_->getBase(), -1);
     delete channel_;
     channel_ = NULL;
 }
@@ -8,15 +8,21 @@ typedef std::shared_ptr<TcpConn> TcpConnPtr;
 typedef std::shared_ptr<TcpServer> TcpServerPtr;
 typedef std::function<void(const TcpConnPtr &)> TcpCallBack;
 typedef std::function<void(const TcpConnPtr &, Slice msg)> MsgCallBack;
+typedef std::function<void(const TcpConnPtr &, const std::vector<Slice> &msgs)> MsgsCallBack;
 
 struct EventBases : private noncopyable {
     virtual EventBase *allocBase() = 0;
+    //为来自peer的连接分配一个事件派发器
+    virtual EventBase *allocBase(const Ip4Addr &peer) { return allocBase(); }
+    //包含的事件派发器个数，以及第i个事件派发器
+    virtual int baseCount() { return 1; }
+    virtual EventBase *getBase(int i) { return allocBase(); }
 };
 
 //事件派发器，可管理定时器，连接，超时连接
 struct EventBase : public EventBases {
-    // taskCapacity指定任务队列的大小，0无限制
-    EventBase(int taskCapacity = 0);
+    // taskCapacity指定任务队列的大小，0无限制；poller指定使用的poller实现
+    EventBase(int taskCapacity = 0, PollerType poller = PollerType::Default);
     ~EventBase();
     //处理已到期的事件,waitMs表示若无当前需要处理的任务，需要等待的时间
     void loop_once(int waitMs);
@@ -25,10 +31,24 @@ struct EventBase : public EventBases {
     //取消定时任务，若timer已经过期，则忽略
     bool cancel(TimerId timerid);
     //添加定时任务，interval=0表示一次性任务，否则为重复任务，时间为毫秒
+    // runAfter使用精确的时钟，在事件循环开始之前调用也不会提前触发
     TimerId runAt(int64_t milli, const Task &task, int64_t interval = 0) { return runAt(milli, Task(task), interval); }
     TimerId runAt(int64_t milli, Task &&task, int64_t interval = 0);
     TimerId runAfter(int64_t milli, const Task &task, int64_t interval = 0) { return runAt(util::timeMilli() + milli, Task(task), interval); }
     TimerId runAfter(int64_t milli, Task &&task, int64_t interval = 0) { return runAt(util::timeMilli() + milli, std::move(task), interval); }
+    //之后在此事件派发器上创建的tcp连接是否使用边缘触发，默认为水平触发
+    void setEdgeTriggered(bool et);
+    bool edgeTriggered();
+    //每个tcp连接在一次读事件中最多读取的字节数，0为不限制。超过后先回调已读到的数据，剩余数据留到下一轮循环，
+    //一个高速传输的连接不会长时间占用事件循环
+    void setReadBudget(size_t bytes);
+    size_t readBudget();
+    //缓存的当前时间，毫秒，在poll返回时以及处理定时器之前更新。用于空闲时间戳、日志等不需要精确时间的场合，避免频繁读取时钟
+    int64_t now();
+    //读取精确的当前时间，同时更新缓存的时间
+    int64_t preciseNow();
+    //是否统计事件循环的忙碌时间，统计时每轮循环多读取两次时钟
+    void trackBusy(bool track);
 
     //下列函数为线程安全的
 
@@ -41,43 +61,70 @@ struct EventBase : public EventBases {
     //添加任务
     void safeCall(Task &&task);
     void safeCall(const Task &task) { safeCall(Task(task)); }
+    //队列中等待执行的任务数
+    size_t taskSize();
+    //绑定在此事件派发器上的tcp连接数
+    int connCount();
+    //最近一秒内事件循环处理事件的时间，微秒。需要先调用trackBusy(true)
+    int64_t busyMicro();
     //分配一个事件派发器
     virtual EventBase *allocBase() { return this; }
+    using EventBases::allocBase;
 
    public:
     std::unique_ptr<EventsImp> imp_;
 };
 
+// MultiBase为新连接选择事件派发器的策略
+enum class BasePolicy {
+    RoundRobin,  //轮流分配
+    LeastConns,  //连接数最少的事件派发器
+    LeastBusy,   //最近一秒内最空闲的事件派发器
+    PeerHash,    //按对端ip哈希，同一客户端的连接总在同一个事件派发器上
+};
+
 //多线程的事件派发器
 struct MultiBase : public EventBases {
-    MultiBase(int sz) : id_(0), bases_(sz) {}
-    virtual EventBase *allocBase() {
-        int c = id_++;
-        return &bases_[c % bases_.size()];
+    MultiBase(int sz, PollerType poller = PollerType::Default) : id_(0), policy_(BasePolicy::RoundRobin) {
+        for (int i = 0; i < sz; i++) {
+            bases_.emplace_back(new EventBase(0, poller));
+        }
     }
+    //设置分配策略，应当在loop之前调用
+    void setPolicy(BasePolicy policy);
+    virtual EventBase *allocBase();
+    virtual EventBase *allocBase(const Ip4Addr &peer);
+    virtual int baseCount() { return (int) bases_.size(); }
+    virtual EventBase *getBase(int i) { return bases_[i].get(); }
     void loop();
     MultiBase &exit() {
         for (auto &b : bases_) {
-            b.exit();
+            b->exit();
         }
         return *this;
     }
 
    private:
     std::atomic<int> id_;
-    std::vector<EventBase> bases_;
+    BasePolicy policy_;
+    std::vector<std::unique_ptr<EventBase>> bases_;
+    EventBase *leastLoaded();
 };
 
 //通道，封装了可以进行epoll的一个fd
 struct Channel : private noncopyable {
     // base为事件管理器，fd为通道内部的fd，events为通道关心的事件
-    Channel(EventBase *base, int fd, int events);
+    // edgeTriggered为true时使用边缘触发，读写两个方向只注册一次，启用与禁用读写不再修改poller
+    // 使用边缘触发时，读写回调需要一直处理到EAGAIN
+    // nonBlocking为true表示fd已经是非阻塞的，不再调用fcntl设置
+    Channel(EventBase *base, int fd, int events, bool edgeTriggered = false, bool nonBlocking = false);
     ~Channel();
     EventBase *getBase() { return base_; }
     int fd() { return fd_; }
     //通道id
     int64_t id() { return id_; }
     short events() { return events_; }
+    bool edgeTriggered() { return edgeTriggered_; }
     //关闭通道
     void close();
 
@@ -98,13 +145,24 @@ struct Channel : private noncopyable {
     void handleRead() { readcb_(); }
     void handleWrite() { writecb_(); }
 
+    //完成模式，见PollerBase::completion。res为读写的结果，出错时为-errno
+    bool completion() { return poller_->completion(); }
+    void submitRead(void *buf, size_t len, const std::shared_ptr<void> &owner) { poller_->submitRead(this, buf, len, owner); }
+    void submitWrite(const struct iovec *iov, int cnt, const std::shared_ptr<void> &owner) { poller_->submitWrite(this, iov, cnt, owner); }
+    void onReadDone(std::function<void(int)> &&cb) { readDone_ = std::move(cb); }
+    void onWriteDone(std::function<void(int)> &&cb) { writeDone_ = std::move(cb); }
+    void handleReadDone(int res) { readDone_(res); }
+    void handleWriteDone(int res) { writeDone_(res); }
+
    protected:
     EventBase *base_;
     PollerBase *poller_;
     int fd_;
     short events_;
+    bool edgeTriggered_;
     int64_t id_;
     std::function<void()> readcb_, writecb_, errorcb_;
+    std::function<void(int)> readDone_, writeDone_;
 };
 
 }  // namespace handy
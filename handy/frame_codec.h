@@ -0,0 +1,207 @@
+#pragma once
+#include <climits>
+#include <cstdint>
+#include "codec.h"
+#include "crc32c.h"
+
+namespace handy {
+
+//编译期组合的消息格式：[魔数][长度][消息][校验]，各部分由模板参数指定，解码与编码都不经过虚函数
+//例如与LengthCodec相同的格式：FrameCodec<FixedLen<4>, Magic<'m', 'B', 'd', 'T'>>
+//需要运行时选择时，使用CodecAdaptor<C>适配为CodecBase
+
+//字节序
+enum class Endian { Big, Little };
+
+//按字节序读写N字节的整数
+template <int N, Endian E>
+struct EndianInt {
+    static void store(uint64_t v, char *p) {
+        for (int i = 0; i < N; i++) {
+            p[E == Endian::Big ? N - 1 - i : i] = char(v >> (8 * i));
+        }
+    }
+    static uint64_t load(const char *p) {
+        uint64_t v = 0;
+        for (int i = 0; i < N; i++) {
+            v |= uint64_t((unsigned char) p[E == Endian::Big ? N - 1 - i : i]) << (8 * i);
+        }
+        return v;
+    }
+};
+
+//长度字段的格式需要提供：
+// kMaxSize 长度字段最多占用的字节数
+// kMaxLen 长度字段能表示的最大长度
+// decode 从p开始的n字节中读出长度，返回长度字段的字节数，0表示数据不足，<0表示格式错误
+// encode 写入长度，返回写入的字节数
+
+//定长的长度字段，N为2、4或8
+template <int N, Endian E = Endian::Big>
+struct FixedLen {
+    static_assert(N == 2 || N == 4 || N == 8, "length field must be 2, 4 or 8 bytes");
+    enum { kMaxSize = N };
+    static constexpr uint64_t kMaxLen = N == 8 ? UINT64_MAX : (uint64_t(1) << (8 * N)) - 1;
+    static int decode(const char *p, size_t n, uint64_t &len) {
+        if (n < (size_t) N) {
+            return 0;
+        }
+        len = EndianInt<N, E>::load(p);
+        return N;
+    }
+    static int encode(uint64_t len, char *p) {
+        EndianInt<N, E>::store(len, p);
+        return N;
+    }
+};
+
+// varint长度字段，每字节7位，低位在前，最高位为1表示后面还有字节
+struct VarintLen {
+    enum { kMaxSize = 10 };
+    static constexpr uint64_t kMaxLen = UINT64_MAX;
+    static int decode(const char *p, size_t n, uint64_t &len) {
+        len = 0;
+        for (size_t i = 0; i < n && i < kMaxSize; i++) {
+            unsigned char c = p[i];
+            len |= uint64_t(c & 0x7f) << (7 * i);
+            if (!(c & 0x80)) {
+                return int(i + 1);
+            }
+        }
+        return n < kMaxSize ? 0 : -1;
+    }
+    static int encode(uint64_t len, char *p) {
+        int i = 0;
+        for (; len >= 0x80; len >>= 7) {
+            p[i++] = char(len | 0x80);
+        }
+        p[i++] = char(len);
+        return i;
+    }
+};
+
+//魔数，放在消息的开头
+template <char... C>
+struct Magic {
+    enum { kSize = sizeof...(C) };
+    static bool match(const char *p) {
+        static const char magic[] = {C...};
+        return memcmp(p, magic, kSize) == 0;
+    }
+    static void put(char *p) {
+        static const char magic[] = {C...};
+        memcpy(p, magic, kSize);
+    }
+};
+
+//没有魔数
+struct NoMagic {
+    enum { kSize = 0 };
+    static bool match(const char *p) { return true; }
+    static void put(char *p) {}
+};
+
+//消息末尾的校验，需要提供kSize，verify检查data[0, len)的校验值是否与sum处的一致，put根据帧头与消息写入校验值
+
+//没有校验
+struct NoCheck {
+    enum { kSize = 0 };
+    static bool verify(const char *data, size_t len, const char *sum) { return true; }
+    static void put(Slice head, Slice msg, char *sum) {}
+};
+
+// CRC32C校验，覆盖魔数、长度与消息
+template <Endian E = Endian::Big>
+struct Crc32cCheck {
+    enum { kSize = 4 };
+    static bool verify(const char *data, size_t len, const char *sum) { return crc32c(0, data, len) == EndianInt<4, E>::load(sum); }
+    static void put(Slice head, Slice msg, char *sum) {
+        EndianInt<4, E>::store(crc32c(crc32c(0, head.data(), head.size()), msg.data(), msg.size()), sum);
+    }
+};
+
+//记录超长而未编码的消息
+void frameTooLarge(size_t len, size_t maxLen);
+
+// MaxLen为消息的最大长度，超过时解码出错，编码时不写入并记录错误。MaxLen不能超过长度字段的表示范围
+template <class Len, class M = NoMagic, class Check = NoCheck, size_t MaxLen = 1024 * 1024>
+struct FrameCodec {
+    static_assert(M::kSize + Len::kMaxSize <= sizeof(CodecFrame().head), "frame head too large");
+    static_assert(MaxLen <= Len::kMaxLen, "MaxLen does not fit in the length field");
+    static_assert(MaxLen + M::kSize + Len::kMaxSize + Check::kSize < INT_MAX, "MaxLen too large");
+    //返回值与CodecBase::tryDecode相同
+    int tryDecode(Slice data, Slice &msg) {
+        const char *p = data.data();
+        size_t n = data.size();
+        if (n < (size_t) M::kSize) {
+            return 0;
+        }
+        if (!M::match(p)) {
+            return -1;
+        }
+        uint64_t len = 0;
+        int r = Len::decode(p + M::kSize, n - M::kSize, len);
+        if (r <= 0) {
+            return r;
+        }
+        if (len > MaxLen) {
+            return -1;
+        }
+        size_t head = M::kSize + r;
+        if (n < head + len + Check::kSize) {
+            return 0;
+        }
+        // the checksum is verified in place, nothing is copied
+        if (!Check::verify(p, head + len, p + head + len)) {
+            return -1;
+        }
+        msg = Slice(p + head, len);
+        return int(head + len + Check::kSize);
+    }
+    bool encodeFrame(Slice msg, CodecFrame &frame) {
+        if (msg.size() > MaxLen) {
+            return false;
+        }
+        M::put(frame.head);
+        frame.headLen = M::kSize + Len::encode(msg.size(), frame.head + M::kSize);
+        Check::put(Slice(frame.head, frame.headLen), msg, frame.tail);
+        frame.tailLen = Check::kSize;
+        return true;
+    }
+    void encode(Slice msg, Buffer &buf) {
+        CodecFrame frame;
+        if (!encodeFrame(msg, frame)) {
+            frameTooLarge(msg.size(), MaxLen);
+            return;
+        }
+        buf.append(frame.head, frame.headLen).append(msg).append(frame.tail, frame.tailLen);
+    }
+};
+
+//把编译期的codec适配为CodecBase，用于运行时选择codec的场合
+template <class C>
+struct CodecAdaptor : public CodecBase {
+    CodecAdaptor(const C &codec = C()) : codec_(codec) {}
+    int tryDecode(Slice data, Slice &msg) override { return codec_.tryDecode(data, msg); }
+    void encode(Slice msg, Buffer &buf) override { codec_.encode(msg, buf); }
+    bool encodeFrame(Slice msg, CodecFrame &frame) override { return codec_.encodeFrame(msg, frame); }
+    CodecBase *clone() override { return new CodecAdaptor<C>(codec_); }
+    //C有reset时转发，有状态的编译期codec在连接重建时同样被清除
+    void reset() override { resetCodec(codec_, 0); }
+    C codec_;
+
+   private:
+    template <class T>
+    static auto resetCodec(T &c, int) -> decltype(c.reset(), void()) {
+        c.reset();
+    }
+    template <class T>
+    static void resetCodec(T &, long) {}
+};
+
+//带校验的LengthCodec：魔数"mBdC"，4字节大端长度，消息末尾为4字节大端的CRC32C，校验失败时解码出错
+typedef FrameCodec<FixedLen<4>, Magic<'m', 'B', 'd', 'C'>, Crc32cCheck<>> Crc32cLengthFrame;
+//运行时使用的版本，如onMsg(new CrcLengthCodec, cb)
+typedef CodecAdaptor<Crc32cLengthFrame> CrcLengthCodec;
+
+}  // namespace handy
@@ -13,10 +13,8 @@ namespace handy {
 struct Channel;
 struct TcpConn;
 struct TcpServer;
-struct IdleIdImp;
 struct EventsImp;
 struct EventBase;
-typedef std::unique_ptr<IdleIdImp> IdleId;
 typedef std::pair<int64_t, int64_t> TimerId;
 
 struct AutoContext : noncopyable {
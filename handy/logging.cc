@@ -113,11 +113,17 @@ void Logger::logv(int level, const char *file, int line, const char *func, const
 
     struct timeval now_tv;
     gettimeofday(&now_tv, NULL);
-    const time_t seconds = now_tv.tv_sec;
-    struct tm t;
-    localtime_r(&seconds, &t);
-    p += snprintf(p, limit - p, "%04d/%02d/%02d-%02d:%02d:%02d.%06d %lx %s %s:%d ", t.tm_year + 1900, t.tm_mon + 1, t.tm_mday, t.tm_hour, t.tm_min, t.tm_sec,
-                  static_cast<int>(now_tv.tv_usec), (long) tid, levelStrs_[level], file, line);
+    // localtime_r takes a lock and may stat the timezone file, format the seconds part once per second
+    static thread_local time_t lastSecond = -1;
+    // sized for the widest ints the format can produce, the fields always fit in practice
+    static thread_local char secondStr[64];
+    if (now_tv.tv_sec != lastSecond) {
+        lastSecond = now_tv.tv_sec;
+        struct tm t;
+        localtime_r(&lastSecond, &t);
+        snprintf(secondStr, sizeof secondStr, "%04d/%02d/%02d-%02d:%02d:%02d", t.tm_year + 1900, t.tm_mon + 1, t.tm_mday, t.tm_hour, t.tm_min, t.tm_sec);
+    }
+    p += snprintf(p, limit - p, "%s.%06d %lx %s %s:%d ", secondStr, static_cast<int>(now_tv.tv_usec), (long) tid, levelStrs_[level], file, line);
     va_list args;
     va_start(args, fmt);
     p += vsnprintf(p, limit - p, fmt, args);
@@ -3,6 +3,7 @@
 #include <fcntl.h>
 #include <netinet/tcp.h>
 #include <sys/socket.h>
+#include <atomic>
 #include <string>
 #include "logging.h"
 #include "util.h"
@@ -79,6 +80,86 @@ bool Ip4Addr::isIpValid() const {
     return addr_.sin_addr.s_addr != INADDR_NONE;
 }
 
+namespace {
+
+// the small classes keep the 512 byte buffers of idle connections small
+const size_t kPoolSizes[] = {512, 1024, 2048, 4096, 16384, 65536};
+const int kPoolClasses = sizeof kPoolSizes / sizeof kPoolSizes[0];
+std::atomic<size_t> g_poolLimit(16 << 20);
+
+struct PoolCache {
+    // free blocks are linked through their first bytes
+    char *free_[kPoolClasses];
+    BufferPool::Stats stats_;
+    PoolCache() : stats_{0, 0, 0} {
+        for (char *&p : free_) {
+            p = NULL;
+        }
+    }
+    ~PoolCache() {
+        for (char *p : free_) {
+            while (p) {
+                char *next = *(char **) p;
+                delete[] p;
+                p = next;
+            }
+        }
+    }
+};
+
+int poolClass(size_t cap) {
+    for (int c = 0; c < kPoolClasses; c++) {
+        if (cap <= kPoolSizes[c]) {
+            return c;
+        }
+    }
+    return -1;
+}
+
+}  // namespace
+
+char *BufferPool::alloc(size_t &cap) {
+    int c = poolClass(cap);
+    PoolCache *pool = c < 0 ? NULL : threadCache<PoolCache>();
+    if (pool == NULL) {
+        return new char[cap];
+    }
+    cap = kPoolSizes[c];
+    char *p = pool->free_[c];
+    if (p) {
+        pool->free_[c] = *(char **) p;
+        pool->stats_.cached -= cap;
+        pool->stats_.hits++;
+        return p;
+    }
+    pool->stats_.misses++;
+    return new char[cap];
+}
+
+void BufferPool::release(char *p, size_t cap) {
+    if (p == NULL) {
+        return;
+    }
+    int c = poolClass(cap);
+    PoolCache *pool = c < 0 || kPoolSizes[c] != cap ? NULL : threadCache<PoolCache>();
+    if (pool == NULL || pool->stats_.cached + cap > g_poolLimit.load(std::memory_order_relaxed)) {
+        delete[] p;
+        return;
+    }
+    *(char **) p = pool->free_[c];
+    pool->free_[c] = p;
+    pool->stats_.cached += cap;
+}
+
+void BufferPool::setLimit(size_t bytes) {
+    g_poolLimit = bytes;
+}
+
+BufferPool::Stats BufferPool::stats() {
+    PoolCache *pool = threadCache<PoolCache>();
+    return pool ? pool->stats_ : Stats{0, 0, 0};
+}
+
 char *Buffer::makeRoom(size_t len) {
     if (e_ + len <= cap_) {
     } else if (size() + len < cap_ / 2) {
@@ -91,11 +172,33 @@ char *Buffer::makeRoom(size_t len) {
 
 void Buffer::expand(size_t len) {
     size_t ncap = std::max(exp_, std::max(2 * cap_, size() + len));
-    char *p = new char[ncap];
+    char *p = BufferPool::alloc(ncap);
+    std::copy(begin(), end(), p);
+    e_ -= b_;
+    b_ = 0;
+    BufferPool::release(buf_, cap_);
+    buf_ = p;
+    cap_ = ncap;
+}
+
+void Buffer::shrink(size_t len) {
+    if (empty()) {
+        clear();
+        return;
+    }
+    size_t ncap = std::max(size(), len);
+    if (ncap >= cap_) {
+        return;
+    }
+    char *p = BufferPool::alloc(ncap);
+    if (ncap >= cap_) {  // rounded up to the current size class
+        BufferPool::release(p, ncap);
+        return;
+    }
     std::copy(begin(), end(), p);
     e_ -= b_;
     b_ = 0;
-    delete[] buf_;
+    BufferPool::release(buf_, cap_);
     buf_ = p;
     cap_ = ncap;
 }
@@ -103,7 +206,7 @@ void Buffer::expand(size_t len) {
 void Buffer::copyFrom(const Buffer &b) {
     memcpy(this, &b, sizeof b);
     if (b.buf_) {
-        buf_ = new char[cap_];
+        buf_ = BufferPool::alloc(cap_);
         memcpy(data(), b.begin(), b.size());
     }
 }
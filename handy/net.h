@@ -45,11 +45,29 @@ struct Ip4Addr {
     struct sockaddr_in addr_;
 };
 
+//线程局部的缓冲区内存池，按512/1K/2K/4K/16K/64K六个规格缓存Buffer释放的内存，分配与释放都在当前线程中进行，不需要加锁
+//每个事件派发器运行在自己的线程中，因此各有一个内存池。更大的内存直接使用new/delete
+struct BufferPool {
+    struct Stats {
+        int64_t hits;    //从池中取得内存的次数
+        int64_t misses;  //池中没有可用内存，重新分配的次数
+        size_t cached;   //池中缓存的字节数
+    };
+    //分配至少cap字节，cap被调整为实际的大小
+    static char *alloc(size_t &cap);
+    //释放alloc分配的内存，池中缓存的内存超过上限时直接释放
+    static void release(char *p, size_t cap);
+    //每个线程的内存池缓存的字节数上限，默认16M，0表示不缓存
+    static void setLimit(size_t bytes);
+    //当前线程的内存池统计
+    static Stats stats();
+};
+
 struct Buffer {
     Buffer() : buf_(NULL), b_(0), e_(0), cap_(0), exp_(512) {}
-    ~Buffer() { delete[] buf_; }
+    ~Buffer() { BufferPool::release(buf_, cap_); }
     void clear() {
-        delete[] buf_;
+        BufferPool::release(buf_, cap_);
         buf_ = NULL;
         cap_ = 0;
         b_ = e_ = 0;
@@ -65,6 +83,9 @@ struct Buffer {
             expand(0);
     }
     size_t space() const { return cap_ - e_; }
+    size_t capacity() const { return cap_; }
+    //释放多余的内存，容量调整为不小于max(size(), len)
+    void shrink(size_t len);
     void addSize(size_t len) { e_ += len; }
     char *allocRoom(size_t len) {
         char *p = makeRoom(len);
@@ -94,7 +115,7 @@ struct Buffer {
     Buffer &operator=(const Buffer &b) {
         if (this == &b)
             return *this;
-        delete[] buf_;
+        BufferPool::release(buf_, cap_);
         buf_ = NULL;
         copyFrom(b);
         return *this;
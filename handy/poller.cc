@@ -1,4 +1,5 @@
 #include <fcntl.h>
+#include <map>
 #include "event_base.h"
 #include "logging.h"
 #include "util.h"
@@ -6,6 +7,16 @@
 
 #ifdef OS_LINUX
 #include <sys/epoll.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(IORING_FEAT_EXT_ARG)
+#define HANDY_HAVE_URING 1
+#endif
+#endif
+#endif
 #elif defined(OS_MACOSX)
 #include <sys/event.h>
 #else
@@ -14,11 +25,69 @@
 
 namespace handy {
 
+template <class F>
+void PollerBase::dispatch(Channel *ch, int events, F alive) {
+    if (events & (POLLERR | POLLHUP)) {
+        // the read handler gets the error or EOF from read, then closes the channel
+        trace("channel %lld fd %d handle error or hangup", (long long) ch->id(), ch->fd());
+        ch->handleRead();
+        return;
+    }
+    if ((events & kReadEvent) && ch->readEnabled()) {
+        trace("channel %lld fd %d handle read", (long long) ch->id(), ch->fd());
+        ch->handleRead();
+    }
+    if ((events & kWriteEvent) && alive() && ch->writeEnabled()) {
+        trace("channel %lld fd %d handle write", (long long) ch->id(), ch->fd());
+        ch->handleWrite();
+    }
+}
+
+// channels indexed by fd. Each registration gets a new sequence, and the kernel event carries the tag
+// seq << 32 | fd, so an event of a removed or replaced channel is detected in O(1) without scanning
+struct ChannelTable {
+    std::vector<Channel *> channels_;
+    std::vector<uint32_t> seqs_;
+    uint32_t seq_;
+    ChannelTable() : seq_(0) {}
+    uint64_t add(Channel *ch) {
+        int fd = ch->fd();
+        if ((size_t) fd >= channels_.size()) {
+            size_t sz = std::max((size_t) fd + 1, channels_.size() * 2);
+            channels_.resize(sz, NULL);
+            seqs_.resize(sz, 0);
+        }
+        channels_[fd] = ch;
+        return renew(fd);
+    }
+    // events tagged before are ignored afterwards
+    uint64_t renew(int fd) {
+        if (++seq_ == 0) {
+            seq_ = 1;  // tag 0 is never used
+        }
+        seqs_[fd] = seq_;
+        return tag(fd);
+    }
+    void remove(int fd) { channels_[fd] = NULL; }
+    uint64_t tag(int fd) const { return (uint64_t) seqs_[fd] << 32 | (uint32_t) fd; }
+    Channel *get(uint64_t tag) const {
+        size_t fd = (uint32_t) tag;
+        return fd < channels_.size() && seqs_[fd] == (uint32_t)(tag >> 32) ? channels_[fd] : NULL;
+    }
+    void closeAll() {
+        for (size_t i = 0; i < channels_.size(); i++) {
+            if (channels_[i]) {
+                channels_[i]->close();
+            }
+        }
+    }
+};
+
 #ifdef OS_LINUX
 
 struct PollerEpoll : public PollerBase {
     int fd_;
-    std::set<Channel *> liveChannels_;
+    ChannelTable channels_;
     // for epoll selected active events
     struct epoll_event activeEvs_[kMaxEvents];
     PollerEpoll();
@@ -29,7 +98,357 @@ struct PollerEpoll : public PollerBase {
     void loop_once(int waitMs) override;
 };
 
-PollerBase *createPoller() {
+#ifdef HANDY_HAVE_URING
+
+// io_uring used as a poller: every channel has a one-shot IORING_OP_POLL_ADD in flight, which is re-armed after
+// it fires. All the arm and remove requests queued in one loop iteration are submitted by the single
+// io_uring_enter that also waits for completions.
+// In completion mode reads and writes of channels are submitted as IORING_OP_RECV / IORING_OP_WRITEV, and
+// their results are handed to the channels when they complete.
+struct PollerUring : public PollerBase {
+    int fd_;
+    bool completion_;
+    unsigned *sqHead_, *sqTail_, *sqMask_, *sqArray_, sqEntries_, sqLocalTail_;
+    unsigned *cqHead_, *cqTail_, *cqMask_;
+    struct io_uring_sqe *sqes_;
+    struct io_uring_cqe *cqes_;
+    void *sqRing_, *cqRing_;
+    size_t sqRingSize_, cqRingSize_, sqesSize_;
+    // the tag of the channel is the user_data of its requests
+    ChannelTable channels_;
+    std::vector<char> armed_;
+    // a read or a write in flight. owner keeps the memory valid until the request completes
+    struct Request {
+        std::shared_ptr<void> owner;
+        std::vector<struct iovec> iov;
+    };
+    // requests of the channel on a fd. io tags are fixed when a channel is added, unlike the poll tags renewed
+    // on every update, so changing the poll events does not drop completions
+    struct IoSlot {
+        uint64_t tag;
+        Request read, write;
+    };
+    std::vector<IoSlot> ios_;
+    // requests of removed channels, cancelled and waiting for their completions
+    std::map<uint64_t, Request> orphans_;
+    struct io_uring_cqe activeEvs_[kMaxEvents];
+    explicit PollerUring(bool completion);
+    ~PollerUring();
+    bool init();
+    void addChannel(Channel *ch) override;
+    void removeChannel(Channel *ch) override;
+    void updateChannel(Channel *ch) override;
+    void loop_once(int waitMs) override;
+    bool completion() override { return completion_; }
+    void submitRead(Channel *ch, void *buf, size_t len, const std::shared_ptr<void> &owner) override;
+    void submitWrite(Channel *ch, const struct iovec *iov, int cnt, const std::shared_ptr<void> &owner) override;
+
+    // the two top bits of the fd part of user_data tell the kind of a request
+    enum : uint64_t {
+        kOpRead = 1u << 30,
+        kOpWrite = 2u << 30,
+        kOpMask = 3u << 30,
+    };
+    struct io_uring_sqe *getSqe();
+    int submit(unsigned minComplete, int waitMs);
+    void arm(Channel *ch);
+    void disarm(int fd);
+    void cancel(uint64_t data, Request &req);
+    // completions of reads and writes
+    void complete(uint64_t data, int res);
+};
+
+PollerUring::PollerUring(bool completion)
+    : fd_(-1), completion_(completion), sqLocalTail_(0), sqes_(NULL), sqRing_(MAP_FAILED), cqRing_(MAP_FAILED), sqRingSize_(0), cqRingSize_(0), sqesSize_(0) {}
+
+bool PollerUring::init() {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof p);
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = kMaxEvents * 4;
+    fd_ = (int) syscall(__NR_io_uring_setup, kMaxEvents / 2, &p);
+    if (fd_ < 0) {
+        info("io_uring_setup failed %d %s", errno, strerror(errno));
+        return false;
+    }
+    util::addFdFlag(fd_, FD_CLOEXEC);
+    if (!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP)) {
+        info("io_uring lacks required features %x", p.features);
+        return false;
+    }
+    // iovecs of a write are copied when it is submitted
+    if (completion_ && !(p.features & IORING_FEAT_SUBMIT_STABLE)) {
+        info("io_uring lacks stable submission, completion mode disabled");
+        completion_ = false;
+    }
+    sqRingSize_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqRingSize_ = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        sqRingSize_ = cqRingSize_ = std::max(sqRingSize_, cqRingSize_);
+    }
+    sqRing_ = mmap(0, sqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+    if (sqRing_ == MAP_FAILED) {
+        return false;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        cqRing_ = sqRing_;
+    } else {
+        cqRing_ = mmap(0, cqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+        if (cqRing_ == MAP_FAILED) {
+            return false;
+        }
+    }
+    sqesSize_ = p.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(0, sqesSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        return false;
+    }
+    sqes_ = (struct io_uring_sqe *) sqes;
+    char *sq = (char *) sqRing_, *cq = (char *) cqRing_;
+    sqHead_ = (unsigned *) (sq + p.sq_off.head);
+    sqTail_ = (unsigned *) (sq + p.sq_off.tail);
+    sqMask_ = (unsigned *) (sq + p.sq_off.ring_mask);
+    sqArray_ = (unsigned *) (sq + p.sq_off.array);
+    sqEntries_ = p.sq_entries;
+    sqLocalTail_ = *sqTail_;
+    cqHead_ = (unsigned *) (cq + p.cq_off.head);
+    cqTail_ = (unsigned *) (cq + p.cq_off.tail);
+    cqMask_ = (unsigned *) (cq + p.cq_off.ring_mask);
+    cqes_ = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+    info("poller io_uring %d created%s", fd_, completion_ ? " in completion mode" : "");
+    return true;
+}
+
+PollerUring::~PollerUring() {
+    info("destroying poller %d", fd_);
+    channels_.closeAll();
+    // the kernel may still use the buffers of cancelled requests, and closing the ring does not wait for
+    // them. a cancelled socket request completes at once, so wait for all of them before the owners go away
+    for (int waited = 0; orphans_.size(); waited++) {
+        if (waited) {
+            warn("waiting for %lu cancelled io_uring requests", orphans_.size());
+        }
+        int r = submit(1, 1000);
+        fatalif(r < 0 && errno != EINTR && errno != ETIME && errno != EBUSY, "io_uring_enter return error %d %s", errno, strerror(errno));
+        unsigned head = *cqHead_;
+        unsigned tail = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            orphans_.erase(cqes_[head & *cqMask_].user_data);
+        }
+        __atomic_store_n(cqHead_, head, __ATOMIC_RELEASE);
+    }
+    if (sqes_) {
+        munmap(sqes_, sqesSize_);
+    }
+    if (cqRing_ != MAP_FAILED && cqRing_ != sqRing_) {
+        munmap(cqRing_, cqRingSize_);
+    }
+    if (sqRing_ != MAP_FAILED) {
+        munmap(sqRing_, sqRingSize_);
+    }
+    if (fd_ >= 0) {
+        ::close(fd_);
+    }
+    info("poller %d destroyed", fd_);
+}
+
+int PollerUring::submit(unsigned minComplete, int waitMs) {
+    unsigned toSubmit = sqLocalTail_ - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE);
+    if (minComplete == 0) {
+        return (int) syscall(__NR_io_uring_enter, fd_, toSubmit, 0, 0, NULL, 0);
+    }
+    struct __kernel_timespec ts;
+    ts.tv_sec = waitMs / 1000;
+    ts.tv_nsec = (waitMs % 1000) * 1000 * 1000;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof arg);
+    arg.ts = (uint64_t)(uintptr_t) &ts;
+    return (int) syscall(__NR_io_uring_enter, fd_, toSubmit, minComplete, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof arg);
+}
+
+struct io_uring_sqe *PollerUring::getSqe() {
+    if (sqLocalTail_ - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE) >= sqEntries_) {
+        int r = submit(0, 0);
+        fatalif(r < 0, "io_uring_enter submit failed %d %s", errno, strerror(errno));
+    }
+    unsigned index = sqLocalTail_ & *sqMask_;
+    struct io_uring_sqe *sqe = &sqes_[index];
+    memset(sqe, 0, sizeof *sqe);
+    sqArray_[index] = index;
+    sqLocalTail_++;
+    __atomic_store_n(sqTail_, sqLocalTail_, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+void PollerUring::arm(Channel *ch) {
+    int fd = ch->fd();
+    if (!(ch->events() & (kReadEvent | kWriteEvent))) {
+        return;
+    }
+    struct io_uring_sqe *sqe = getSqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = ch->events();
+    sqe->user_data = channels_.tag(fd);
+    armed_[fd] = 1;
+}
+
+void PollerUring::disarm(int fd) {
+    if (armed_[fd]) {
+        struct io_uring_sqe *sqe = getSqe();
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = channels_.tag(fd);
+        armed_[fd] = 0;
+    }
+}
+
+void PollerUring::cancel(uint64_t data, Request &req) {
+    struct io_uring_sqe *sqe = getSqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = data;
+    orphans_[data] = std::move(req);
+    req.owner.reset();
+}
+
+void PollerUring::addChannel(Channel *ch) {
+    int fd = ch->fd();
+    trace("adding channel %lld fd %d events %d io_uring %d", (long long) ch->id(), fd, ch->events(), fd_);
+    fatalif(fd & kOpMask, "fd %d too large for io_uring tags", fd);
+    channels_.add(ch);
+    if ((size_t) fd >= armed_.size()) {
+        armed_.resize(channels_.channels_.size(), 0);
+        ios_.resize(channels_.channels_.size());
+    }
+    armed_[fd] = 0;
+    ios_[fd].tag = channels_.tag(fd);
+    arm(ch);
+}
+
+void PollerUring::updateChannel(Channel *ch) {
+    int fd = ch->fd();
+    trace("modifying channel %lld fd %d events read %d write %d io_uring %d", (long long) ch->id(), fd, ch->events() & POLLIN, ch->events() & POLLOUT, fd_);
+    disarm(fd);
+    channels_.renew(fd);
+    arm(ch);
+}
+
+void PollerUring::removeChannel(Channel *ch) {
+    int fd = ch->fd();
+    trace("deleting channel %lld fd %d io_uring %d", (long long) ch->id(), fd, fd_);
+    channels_.remove(fd);
+    IoSlot &io = ios_[fd];
+    bool pending = armed_[fd] || io.read.owner || io.write.owner;
+    disarm(fd);
+    if (io.read.owner) {
+        cancel(io.tag | kOpRead, io.read);
+    }
+    if (io.write.owner) {
+        cancel(io.tag | kOpWrite, io.write);
+    }
+    io.tag = 0;
+    if (pending) {
+        // the pending requests hold a reference of the socket, submit the removal before the fd is closed
+        int r = submit(0, 0);
+        fatalif(r < 0, "io_uring_enter submit failed %d %s", errno, strerror(errno));
+    }
+}
+
+void PollerUring::submitRead(Channel *ch, void *buf, size_t len, const std::shared_ptr<void> &owner) {
+    int fd = ch->fd();
+    IoSlot &io = ios_[fd];
+    fatalif(io.read.owner, "channel %lld fd %d has a read in flight", (long long) ch->id(), fd);
+    io.read.owner = owner;
+    struct io_uring_sqe *sqe = getSqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t) buf;
+    sqe->len = len;
+    sqe->user_data = io.tag | kOpRead;
+}
+
+void PollerUring::submitWrite(Channel *ch, const struct iovec *iov, int cnt, const std::shared_ptr<void> &owner) {
+    int fd = ch->fd();
+    IoSlot &io = ios_[fd];
+    fatalif(io.write.owner, "channel %lld fd %d has a write in flight", (long long) ch->id(), fd);
+    io.write.owner = owner;
+    io.write.iov.assign(iov, iov + cnt);
+    struct io_uring_sqe *sqe = getSqe();
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t) io.write.iov.data();
+    sqe->len = cnt;
+    sqe->user_data = io.tag | kOpWrite;
+}
+
+void PollerUring::complete(uint64_t data, int res) {
+    uint64_t op = data & kOpMask, tag = data & ~(uint64_t) kOpMask;
+    size_t fd = (uint32_t) tag;
+    Channel *ch = fd < ios_.size() && ios_[fd].tag == tag ? channels_.channels_[fd] : NULL;
+    if (ch == NULL) {
+        orphans_.erase(data);
+        return;
+    }
+    // the kernel is done with the memory, the callback may reuse it for the next request
+    Request &req = op == kOpRead ? ios_[fd].read : ios_[fd].write;
+    req.owner.reset();
+    trace("channel %lld fd %d %s done %d", (long long) ch->id(), ch->fd(), op == kOpRead ? "read" : "write", res);
+    if (op == kOpRead) {
+        ch->handleReadDone(res);
+    } else {
+        ch->handleWriteDone(res);
+    }
+}
+
+void PollerUring::loop_once(int waitMs) {
+    int r = submit(1, waitMs);
+    awake();
+    fatalif(r < 0 && errno != EINTR && errno != ETIME && errno != EBUSY, "io_uring_enter return error %d %s", errno, strerror(errno));
+    unsigned head = *cqHead_;
+    unsigned tail = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+    int n = 0;
+    while (head != tail && n < kMaxEvents) {
+        activeEvs_[n++] = cqes_[head & *cqMask_];
+        head++;
+    }
+    __atomic_store_n(cqHead_, head, __ATOMIC_RELEASE);
+    trace("io_uring wait %d return %d errno %d", waitMs, n, errno);
+    for (int i = 0; i < n; i++) {
+        uint64_t tag = activeEvs_[i].user_data;
+        int events = activeEvs_[i].res;
+        if (tag == 0) {
+            continue;  // results of poll removals and cancellations
+        }
+        if (tag & kOpMask) {
+            complete(tag, events);
+            continue;
+        }
+        Channel *ch = channels_.get(tag);
+        if (ch == NULL) {
+            continue;
+        }
+        armed_[ch->fd()] = 0;
+        dispatch(ch, events < 0 ? POLLERR : events, [this, tag, ch] { return channels_.get(tag) == ch; });
+        if (channels_.get(tag) == ch) {
+            arm(ch);
+        }
+    }
+}
+
+#endif
+
+PollerBase *createPoller(PollerType type) {
+#ifdef HANDY_HAVE_URING
+    if (type == PollerType::IoUring || type == PollerType::IoUringCompletion) {
+        PollerUring *p = new PollerUring(type == PollerType::IoUringCompletion);
+        if (p->init()) {
+            return p;
+        }
+        info("io_uring not available, fall back to epoll");
+        delete p;
+    }
+#endif
     return new PollerEpoll();
 }
 
@@ -41,9 +460,7 @@ PollerEpoll::PollerEpoll() {
 
 PollerEpoll::~PollerEpoll() {
     info("destroying poller %d", fd_);
-    while (liveChannels_.size()) {
-        (*liveChannels_.begin())->close();
-    }
+    channels_.closeAll();
     ::close(fd_);
     info("poller %d destroyed", fd_);
 }
@@ -51,19 +468,22 @@ PollerEpoll::~PollerEpoll() {
 void PollerEpoll::addChannel(Channel *ch) {
     struct epoll_event ev;
     memset(&ev, 0, sizeof(ev));
-    ev.events = ch->events();
-    ev.data.ptr = ch;
+    // edge triggered channels are registered for both directions once, enabled events are checked when dispatching
+    ev.events = ch->edgeTriggered() ? kReadEvent | kWriteEvent | EPOLLET : ch->events();
+    ev.data.u64 = channels_.add(ch);
     trace("adding channel %lld fd %d events %d epoll %d", (long long) ch->id(), ch->fd(), ev.events, fd_);
     int r = epoll_ctl(fd_, EPOLL_CTL_ADD, ch->fd(), &ev);
     fatalif(r, "epoll_ctl add failed %d %s", errno, strerror(errno));
-    liveChannels_.insert(ch);
 }
 
 void PollerEpoll::updateChannel(Channel *ch) {
+    if (ch->edgeTriggered()) {
+        return;
+    }
     struct epoll_event ev;
     memset(&ev, 0, sizeof(ev));
     ev.events = ch->events();
-    ev.data.ptr = ch;
+    ev.data.u64 = channels_.tag(ch->fd());
     trace("modifying channel %lld fd %d events read %d write %d epoll %d", (long long) ch->id(), ch->fd(), ev.events & POLLIN, ev.events & POLLOUT, fd_);
     int r = epoll_ctl(fd_, EPOLL_CTL_MOD, ch->fd(), &ev);
     fatalif(r, "epoll_ctl mod failed %d %s", errno, strerror(errno));
@@ -71,35 +491,22 @@ void PollerEpoll::updateChannel(Channel *ch) {
 
 void PollerEpoll::removeChannel(Channel *ch) {
     trace("deleting channel %lld fd %d epoll %d", (long long) ch->id(), ch->fd(), fd_);
-    liveChannels_.erase(ch);
-    for (int i = lastActive_; i >= 0; i--) {
-        if (ch == activeEvs_[i].data.ptr) {
-            activeEvs_[i].data.ptr = NULL;
-            break;
-        }
-    }
+    // events of this channel already returned in activeEvs_ no longer match the table
+    channels_.remove(ch->fd());
 }
 
 void PollerEpoll::loop_once(int waitMs) {
-    int64_t ticks = util::timeMilli();
     lastActive_ = epoll_wait(fd_, activeEvs_, kMaxEvents, waitMs);
-    int64_t used = util::timeMilli() - ticks;
-    trace("epoll wait %d return %d errno %d used %lld millsecond", waitMs, lastActive_, errno, (long long) used);
+    awake();
+    trace("epoll wait %d return %d errno %d", waitMs, lastActive_, errno);
     fatalif(lastActive_ == -1 && errno != EINTR, "epoll return error %d %s", errno, strerror(errno));
     while (--lastActive_ >= 0) {
         int i = lastActive_;
-        Channel *ch = (Channel *) activeEvs_[i].data.ptr;
+        uint64_t tag = activeEvs_[i].data.u64;
         int events = activeEvs_[i].events;
+        Channel *ch = channels_.get(tag);
         if (ch) {
-            if (events & (kReadEvent | POLLERR)) {
-                trace("channel %lld fd %d handle read", (long long) ch->id(), ch->fd());
-                ch->handleRead();
-            } else if (events & kWriteEvent) {
-                trace("channel %lld fd %d handle write", (long long) ch->id(), ch->fd());
-                ch->handleWrite();
-            } else {
-                fatal("unexpected poller events");
-            }
+            dispatch(ch, events, [this, tag, ch] { return channels_.get(tag) == ch; });
         }
     }
 }
@@ -108,8 +515,8 @@ void PollerEpoll::loop_once(int waitMs) {
 
 struct PollerKqueue : public PollerBase {
     int fd_;
-    std::set<Channel *> liveChannels_;
-    // for epoll selected active events
+    ChannelTable channels_;
+    // for kqueue selected active events
     struct kevent activeEvs_[kMaxEvents];
     PollerKqueue();
     ~PollerKqueue();
@@ -119,7 +526,7 @@ struct PollerKqueue : public PollerBase {
     void loop_once(int waitMs) override;
 };
 
-PollerBase *createPoller() {
+PollerBase *createPoller(PollerType type) {
     return new PollerKqueue();
 }
 
@@ -131,9 +538,7 @@ PollerKqueue::PollerKqueue() {
 
 PollerKqueue::~PollerKqueue() {
     info("destroying poller %d", fd_);
-    while (liveChannels_.size()) {
-        (*liveChannels_.begin())->close();
-    }
+    channels_.closeAll();
     ::close(fd_);
     info("poller %d destroyed", fd_);
 }
@@ -144,33 +549,41 @@ void PollerKqueue::addChannel(Channel *ch) {
     now.tv_sec = 0;
     struct kevent ev[2];
     int n = 0;
-    if (ch->readEnabled()) {
-        EV_SET(&ev[n++], ch->fd(), EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, ch);
+    void *tag = (void *) (uintptr_t) channels_.add(ch);
+    if (ch->edgeTriggered()) {
+        EV_SET(&ev[n++], ch->fd(), EVFILT_READ, EV_ADD | EV_ENABLE | EV_CLEAR, 0, 0, tag);
+        EV_SET(&ev[n++], ch->fd(), EVFILT_WRITE, EV_ADD | EV_ENABLE | EV_CLEAR, 0, 0, tag);
     }
-    if (ch->writeEnabled()) {
-        EV_SET(&ev[n++], ch->fd(), EVFILT_WRITE, EV_ADD | EV_ENABLE, 0, 0, ch);
+    if (ch->readEnabled() && !ch->edgeTriggered()) {
+        EV_SET(&ev[n++], ch->fd(), EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, tag);
+    }
+    if (ch->writeEnabled() && !ch->edgeTriggered()) {
+        EV_SET(&ev[n++], ch->fd(), EVFILT_WRITE, EV_ADD | EV_ENABLE, 0, 0, tag);
     }
     trace("adding channel %lld fd %d events read %d write %d  epoll %d", (long long) ch->id(), ch->fd(), ch->events() & POLLIN, ch->events() & POLLOUT, fd_);
     int r = kevent(fd_, ev, n, NULL, 0, &now);
     fatalif(r, "kevent add failed %d %s", errno, strerror(errno));
-    liveChannels_.insert(ch);
 }
 
 void PollerKqueue::updateChannel(Channel *ch) {
+    if (ch->edgeTriggered()) {
+        return;
+    }
     struct timespec now;
     now.tv_nsec = 0;
     now.tv_sec = 0;
     struct kevent ev[2];
     int n = 0;
+    void *tag = (void *) (uintptr_t) channels_.tag(ch->fd());
     if (ch->readEnabled()) {
-        EV_SET(&ev[n++], ch->fd(), EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, ch);
+        EV_SET(&ev[n++], ch->fd(), EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, tag);
     } else {
-        EV_SET(&ev[n++], ch->fd(), EVFILT_READ, EV_DELETE, 0, 0, ch);
+        EV_SET(&ev[n++], ch->fd(), EVFILT_READ, EV_DELETE, 0, 0, tag);
     }
     if (ch->writeEnabled()) {
-        EV_SET(&ev[n++], ch->fd(), EVFILT_WRITE, EV_ADD | EV_ENABLE, 0, 0, ch);
+        EV_SET(&ev[n++], ch->fd(), EVFILT_WRITE, EV_ADD | EV_ENABLE, 0, 0, tag);
     } else {
-        EV_SET(&ev[n++], ch->fd(), EVFILT_WRITE, EV_DELETE, 0, 0, ch);
+        EV_SET(&ev[n++], ch->fd(), EVFILT_WRITE, EV_DELETE, 0, 0, tag);
     }
     trace("modifying channel %lld fd %d events read %d write %d epoll %d", (long long) ch->id(), ch->fd(), ch->events() & POLLIN, ch->events() & POLLOUT, fd_);
     int r = kevent(fd_, ev, n, NULL, 0, &now);
@@ -179,39 +592,30 @@ void PollerKqueue::updateChannel(Channel *ch) {
 
 void PollerKqueue::removeChannel(Channel *ch) {
     trace("deleting channel %lld fd %d epoll %d", (long long) ch->id(), ch->fd(), fd_);
-    liveChannels_.erase(ch);
-    // remove channel if in ready stat
-    for (int i = lastActive_; i >= 0; i--) {
-        if (ch == activeEvs_[i].udata) {
-            activeEvs_[i].udata = NULL;
-            break;
-        }
-    }
+    // events of this channel already returned in activeEvs_ no longer match the table
+    channels_.remove(ch->fd());
 }
 
 void PollerKqueue::loop_once(int waitMs) {
     struct timespec timeout;
     timeout.tv_sec = waitMs / 1000;
     timeout.tv_nsec = (waitMs % 1000) * 1000 * 1000;
-    long ticks = util::timeMilli();
     lastActive_ = kevent(fd_, NULL, 0, activeEvs_, kMaxEvents, &timeout);
-    trace("kevent wait %d return %d errno %d used %lld millsecond", waitMs, lastActive_, errno, util::timeMilli() - ticks);
+    awake();
+    trace("kevent wait %d return %d errno %d", waitMs, lastActive_, errno);
     fatalif(lastActive_ == -1 && errno != EINTR, "kevent return error %d %s", errno, strerror(errno));
     while (--lastActive_ >= 0) {
         int i = lastActive_;
-        Channel *ch = (Channel *) activeEvs_[i].udata;
         struct kevent &ke = activeEvs_[i];
+        uint64_t tag = (uintptr_t) ke.udata;
+        Channel *ch = channels_.get(tag);
         if (ch) {
-            // only handle write if read and write are enabled
-            if (!(ke.flags & EV_EOF) && ch->writeEnabled()) {
-                trace("channel %lld fd %d handle write", (long long) ch->id(), ch->fd());
-                ch->handleWrite();
-            } else if ((ke.flags & EV_EOF) || ch->readEnabled()) {
-                trace("channel %lld fd %d handle read", (long long) ch->id(), ch->fd());
-                ch->handleRead();
-            } else {
-                fatal("unexpected epoll events %d", ch->events());
+            // kqueue reports each filter separately, both of them are in the same batch when ready together
+            int events = ke.filter == EVFILT_READ ? kReadEvent : kWriteEvent;
+            if (ke.flags & (EV_EOF | EV_ERROR)) {
+                events |= POLLHUP;
             }
+            dispatch(ch, events, [this, tag, ch] { return channels_.get(tag) == ch; });
         }
     }
 }
@@ -4,8 +4,10 @@
 #include <cstring>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <atomic>
 #include <map>
+#include <memory>
 
 namespace handy {
 
@@ -16,7 +18,12 @@ const int kWriteEvent = POLLOUT;
 struct PollerBase : private noncopyable {
     int64_t id_;
     int lastActive_;
-    PollerBase() : lastActive_(-1) {
+    //poll返回时的时间，毫秒，每轮事件循环只读取一次时钟
+    int64_t now_;
+    //是否统计事件循环的忙碌时间。awake_为poll返回时的单调时钟，微秒
+    bool trackBusy_;
+    int64_t awake_;
+    PollerBase() : lastActive_(-1), now_(util::timeMilli()), trackBusy_(false), awake_(0) {
         static std::atomic<int64_t> id(0);
         id_ = ++id;
     }
@@ -25,8 +32,37 @@ struct PollerBase : private noncopyable {
     virtual void updateChannel(Channel *ch) = 0;
     virtual void loop_once(int waitMs) = 0;
     virtual ~PollerBase(){};
+    //完成模式：读写请求由poller提交，内核完成后通过Channel::handleReadDone/handleWriteDone回调结果
+    //只有IoUringCompletion支持，其他poller返回false
+    virtual bool completion() { return false; }
+    //提交读请求，数据读入buf。owner在请求完成之前保持buf有效，通道移除时请求被取消
+    virtual void submitRead(Channel *ch, void *buf, size_t len, const std::shared_ptr<void> &owner) {}
+    //提交写请求，写出iov中的数据。iov被复制，owner在请求完成之前保持数据有效
+    virtual void submitWrite(Channel *ch, const struct iovec *iov, int cnt, const std::shared_ptr<void> &owner) {}
+
+   protected:
+    // poll返回时调用，更新缓存的时间
+    void awake() {
+        now_ = util::timeMilli();
+        if (trackBusy_) {
+            awake_ = util::steadyMicro();
+        }
+    }
+    //处理一个通道上的事件。错误与挂断交给读回调处理；否则可读与可写在同一次派发中都会处理
+    // alive用于在读回调之后检查通道是否仍然有效
+    template <class F>
+    void dispatch(Channel *ch, int events, F alive);
+};
+
+// poller的实现方式。Default在linux下为epoll，在mac下为kqueue
+// IoUring仅在linux下有效，内核不支持时自动使用epoll
+// IoUringCompletion在IoUring的基础上，连接建立后TcpConn的读写作为io_uring请求提交，一轮循环中所有连接的读写通过一次系统调用提交
+enum class PollerType {
+    Default,
+    IoUring,
+    IoUringCompletion,
 };
 
-PollerBase *createPoller();
+PollerBase *createPoller(PollerType type = PollerType::Default);
 
 }  // namespace handy
\ No newline at end of file
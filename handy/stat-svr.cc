@@ -97,4 +97,11 @@ void StatServer::onPageFile(const string &page, const string &desc, const string
     });
 }
 
+void StatServer::onServerStats(const string &name, const TcpServerStatsPtr &stats) {
+    onState(name + "-conns", "current connections", [stats]() -> int64_t { return stats->conns; });
+    onState(name + "-accepted", "accepted connections", [stats]() -> int64_t { return stats->accepted; });
+    onState(name + "-rejected", "connections rejected by the limits or fd exhaustion", [stats]() -> int64_t { return stats->rejected; });
+    onState(name + "-paused", "times accepting paused for fd exhaustion", [stats]() -> int64_t { return stats->paused; });
+}
+
 }  // namespace handy
\ No newline at end of file
@@ -36,6 +36,8 @@ struct StatServer : private noncopyable {
     void onCmd(const string &cmd, const string &desc, const IntCallBack &cb) {
         onRequest(CMD, cmd, desc, [cb] { return util::format("%ld", cb()); });
     }
+    //展示TcpServer的连接统计，状态名为name加上-conns -accepted -rejected -paused
+    void onServerStats(const string &name, const TcpServerStatsPtr &stats);
 
    private:
     HttpServer server_;
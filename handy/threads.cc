@@ -7,6 +7,7 @@ using namespace std;
 namespace handy {
 
 template class SafeQueue<Task>;
+template class MpscQueue<Task>;
 
 ThreadPool::ThreadPool(int threads, int maxWaiting, bool start) : tasks_(maxWaiting), threads_(threads) {
     if (start) {
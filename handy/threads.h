@@ -38,6 +38,52 @@ struct SafeQueue : private std::mutex, private noncopyable {
 typedef std::function<void()> Task;
 extern template class SafeQueue<Task>;
 
+//无锁的多生产者单消费者队列，push可在任意线程调用，pop只能在单个消费者线程中调用
+template <typename T>
+struct MpscQueue : private noncopyable {
+    // 0 不限制队列中的任务数
+    MpscQueue(size_t capacity = 0);
+    ~MpscQueue();
+    //队列满则返回false
+    bool push(T &&v);
+    //队列为空返回false
+    bool pop(T *v);
+    //取出调用时队列中的所有元素，依次调用f(T&&)，返回取出的个数。f中不能调用pop或popAll，可以push
+    //整批只回收一次节点、更新一次计数，f中push的元素留给下一次取出
+    template <class F>
+    size_t popAll(F f);
+    size_t size() { return size_.load(std::memory_order_relaxed); }
+
+   private:
+    struct Node {
+        std::atomic<Node *> next;
+        T value;
+    };
+    //生产者线程的空闲节点，按队列编号分开缓存，用完后从对应队列的free_中整体取回，节点不会在队列之间转移
+    //同时push的队列超过kQueues个时，轮流释放其中一个队列的缓存
+    struct NodeCache {
+        enum { kQueues = 8 };
+        uint64_t ids[kQueues] = {};
+        Node *nodes[kQueues] = {};
+        int victim = 0;
+        ~NodeCache() {
+            for (int i = 0; i < kQueues; i++) {
+                freeNodes(nodes[i]);
+            }
+        }
+        Node *&slot(uint64_t id);
+    };
+    std::atomic<Node *> head_;  //最近push的节点
+    Node *tail_;                //已被消费的节点，它的next为下一个待消费的节点
+    std::atomic<Node *> free_;  //消费者回收的节点，只有消费者放入，生产者整体取走，没有ABA问题
+    std::atomic<size_t> size_;
+    size_t capacity_;
+    uint64_t id_;  //队列的唯一编号，不复用，队列销毁后线程缓存中残留的节点不会被新队列取到
+    Node *newNode();
+    static void freeNodes(Node *n);
+};
+extern template class MpscQueue<Task>;
+
 struct ThreadPool : private noncopyable {
     //创建线程池
     ThreadPool(int threads, int taskCapacity = 0, bool start = true);
@@ -121,4 +167,132 @@ T SafeQueue<T>::pop_wait(int waitMs) {
     return r;
 }
 
+template <typename T>
+MpscQueue<T>::MpscQueue(size_t capacity) : size_(0), capacity_(capacity) {
+    static std::atomic<uint64_t> lastId(0);
+    id_ = ++lastId;
+    tail_ = new Node();
+    tail_->next.store(NULL, std::memory_order_relaxed);
+    head_.store(tail_, std::memory_order_relaxed);
+    free_.store(NULL, std::memory_order_relaxed);
+}
+
+template <typename T>
+MpscQueue<T>::~MpscQueue() {
+    freeNodes(tail_);
+    freeNodes(free_.load(std::memory_order_acquire));
+}
+
+template <typename T>
+void MpscQueue<T>::freeNodes(Node *n) {
+    while (n) {
+        Node *next = n->next.load(std::memory_order_relaxed);
+        delete n;
+        n = next;
+    }
+}
+
+template <typename T>
+typename MpscQueue<T>::Node *&MpscQueue<T>::NodeCache::slot(uint64_t id) {
+    for (int i = 0; i < kQueues; i++) {
+        if (ids[i] == id) {
+            return nodes[i];
+        }
+    }
+    int i = victim;
+    victim = (victim + 1) % kQueues;
+    freeNodes(nodes[i]);
+    nodes[i] = NULL;
+    ids[i] = id;
+    return nodes[i];
+}
+
+template <typename T>
+typename MpscQueue<T>::Node *MpscQueue<T>::newNode() {
+    NodeCache *cache = threadCache<NodeCache>();
+    if (cache == NULL) {
+        return new Node();
+    }
+    Node *&nodes = cache->slot(id_);
+    if (nodes == NULL) {
+        nodes = free_.exchange(NULL, std::memory_order_acquire);
+    }
+    Node *n = nodes;
+    if (n == NULL) {
+        return new Node();
+    }
+    nodes = n->next.load(std::memory_order_relaxed);
+    return n;
+}
+
+template <typename T>
+bool MpscQueue<T>::push(T &&v) {
+    if (size_.fetch_add(1, std::memory_order_relaxed) >= capacity_ && capacity_) {
+        size_.fetch_sub(1, std::memory_order_relaxed);
+        return false;
+    }
+    Node *n = newNode();
+    n->next.store(NULL, std::memory_order_relaxed);
+    n->value = std::move(v);
+    Node *prev = head_.exchange(n, std::memory_order_acq_rel);
+    prev->next.store(n, std::memory_order_release);
+    return true;
+}
+
+template <typename T>
+bool MpscQueue<T>::pop(T *v) {
+    Node *next = tail_->next.load(std::memory_order_acquire);
+    if (next == NULL) {
+        return false;
+    }
+    *v = std::move(next->value);
+    next->value = T();
+    // the consumed node goes back to the producers instead of being freed
+    Node *n = tail_;
+    Node *top = free_.load(std::memory_order_relaxed);
+    do {
+        n->next.store(top, std::memory_order_relaxed);
+    } while (!free_.compare_exchange_weak(top, n, std::memory_order_release, std::memory_order_relaxed));
+    tail_ = next;
+    size_.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+}
+
+template <typename T>
+template <class F>
+size_t MpscQueue<T>::popAll(F f) {
+    // stop at the element pushed last before the call, producers keeping the queue busy do not hold the consumer here
+    Node *last = head_.load(std::memory_order_acquire);
+    Node *first = tail_, *end = tail_;
+    size_t n = 0;
+    while (end != last) {
+        Node *next = end->next.load(std::memory_order_acquire);
+        if (next == NULL) {  // a producer has taken head_ but not linked its node yet
+            break;
+        }
+        end = next;
+        n++;
+    }
+    if (n == 0) {
+        return 0;
+    }
+    tail_ = end;
+    size_.fetch_sub(n, std::memory_order_relaxed);
+    // the values stay in their nodes until f returns, the consumed nodes are recycled together afterwards
+    Node *prev = first;
+    for (Node *node = first->next.load(std::memory_order_relaxed);; node = node->next.load(std::memory_order_relaxed)) {
+        f(std::move(node->value));
+        node->value = T();
+        if (node == end) {
+            break;
+        }
+        prev = node;
+    }
+    Node *top = free_.load(std::memory_order_relaxed);
+    do {
+        prev->next.store(top, std::memory_order_relaxed);
+    } while (!free_.compare_exchange_weak(top, first, std::memory_order_release, std::memory_order_relaxed));
+    return n;
+}
+
 }  // namespace handy
@@ -0,0 +1,172 @@
+#include "timer_wheel.h"
+#include <algorithm>
+#include <limits>
+
+namespace handy {
+
+namespace {
+
+const int64_t kNever = std::numeric_limits<int64_t>::max();
+
+}  // namespace
+
+TimerWheel::TimerWheel(int64_t now) : current_(now), nearest_(kNever), size_(0) {
+    for (auto &head : root_) {
+        init(&head);
+    }
+    for (auto &level : levels_) {
+        for (auto &head : level) {
+            init(&head);
+        }
+    }
+    init(&expired_);
+}
+
+void TimerWheel::append(TimerNode *head, TimerNode *node) {
+    node->prev_ = head->prev_;
+    node->next_ = head;
+    head->prev_->next_ = node;
+    head->prev_ = node;
+}
+
+void TimerWheel::unlink(TimerNode *node) {
+    node->prev_->next_ = node->next_;
+    node->next_->prev_ = node->prev_;
+    node->prev_ = node->next_ = NULL;
+}
+
+void TimerWheel::splice(TimerNode *to, TimerNode *from) {
+    if (empty(from)) {
+        return;
+    }
+    from->next_->prev_ = to->prev_;
+    to->prev_->next_ = from->next_;
+    from->prev_->next_ = to;
+    to->prev_ = from->prev_;
+    init(from);
+}
+
+void TimerWheel::place(TimerNode *node) {
+    // already expired timers go to the slot processed next
+    int64_t at = node->at_ < current_ ? current_ : node->at_;
+    int64_t delta = at - current_;
+    if (delta < kRootSize) {
+        append(&root_[at & (kRootSize - 1)], node);
+        return;
+    }
+    for (int level = 0; level < kLevels; level++) {
+        int shift = kRootBits + level * kLevelBits;
+        if (delta < (int64_t(1) << (shift + kLevelBits)) || level == kLevels - 1) {
+            if (delta >= (int64_t(1) << (shift + kLevelBits))) {
+                // out of range, park it in the farthest slot, it will be placed again when cascaded
+                at = current_ + (int64_t(1) << (shift + kLevelBits)) - 1;
+            }
+            append(&levels_[level][(at >> shift) & (kLevelSize - 1)], node);
+            return;
+        }
+    }
+}
+
+void TimerWheel::cascade(int level, int index) {
+    TimerNode lst;
+    init(&lst);
+    splice(&lst, &levels_[level][index]);
+    while (!empty(&lst)) {
+        TimerNode *node = lst.next_;
+        unlink(node);
+        place(node);
+    }
+}
+
+void TimerWheel::add(TimerNode *node, int64_t at) {
+    remove(node);
+    node->at_ = at;
+    place(node);
+    size_++;
+    if (at < nearest_) {
+        nearest_ = at;
+    }
+}
+
+void TimerWheel::remove(TimerNode *node) {
+    if (node->linked()) {
+        unlink(node);
+        size_--;
+    }
+}
+
+void TimerWheel::expire(int64_t now) {
+    while (current_ <= now) {
+        if (size_ == 0) {
+            current_ = now + 1;
+            break;
+        }
+        int index = current_ & (kRootSize - 1);
+        if (index != 0 && empty(&root_[index])) {
+            // skip the empty slots, so a long sleep or a clock jump does not cost a step per millisecond
+            current_ = std::min(next(), now + 1);
+            continue;
+        }
+        if (index == 0) {
+            for (int level = 0; level < kLevels; level++) {
+                int i = (current_ >> (kRootBits + level * kLevelBits)) & (kLevelSize - 1);
+                cascade(level, i);
+                if (i != 0) {
+                    break;
+                }
+            }
+        }
+        splice(&expired_, &root_[index]);
+        current_++;
+    }
+}
+
+TimerNode *TimerWheel::popExpired() {
+    if (empty(&expired_)) {
+        return NULL;
+    }
+    TimerNode *node = expired_.next_;
+    unlink(node);
+    size_--;
+    return node;
+}
+
+int64_t TimerWheel::next() const {
+    int64_t t = kNever;
+    for (int i = 0; i < kRootSize; i++) {
+        if (!empty(&root_[(current_ + i) & (kRootSize - 1)])) {
+            t = current_ + i;
+            break;
+        }
+    }
+    // timers in upper levels are due no earlier than the cascade of their slot
+    for (int level = 0; level < kLevels; level++) {
+        int shift = kRootBits + level * kLevelBits;
+        int64_t base = current_ >> shift;
+        int k = (current_ & ((int64_t(1) << shift) - 1)) == 0 ? 0 : 1;
+        for (int end = k + kLevelSize; k < end; k++) {
+            int64_t c = (base + k) << shift;
+            if (c >= t) {
+                break;
+            }
+            if (!empty(&levels_[level][(base + k) & (kLevelSize - 1)])) {
+                t = c;
+                break;
+            }
+        }
+    }
+    return t;
+}
+
+void TimerWheel::refreshNearest() {
+    if (nearest_ >= current_) {
+        return;
+    }
+    if (!empty(&expired_)) {
+        nearest_ = current_ - 1;
+    } else {
+        nearest_ = size_ ? next() : kNever;
+    }
+}
+
+}  // namespace handy
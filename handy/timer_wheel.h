@@ -0,0 +1,64 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include "util.h"
+
+namespace handy {
+
+//时间轮中的节点，可以嵌入到其他对象中，避免额外的内存分配
+struct TimerNode {
+    TimerNode() : prev_(NULL), next_(NULL), at_(0) {}
+    //节点是否在时间轮中
+    bool linked() const { return prev_ != NULL; }
+    //到期时间，毫秒
+    int64_t at() const { return at_; }
+
+    TimerNode *prev_, *next_;
+    int64_t at_;
+};
+
+//分层时间轮，精度为1毫秒，添加与删除均为O(1)
+//第0层256个槽，覆盖256ms，其余4层各64个槽，总共覆盖2^32ms(约49天)，更远的定时器在层间逐步下移
+struct TimerWheel : private noncopyable {
+    explicit TimerWheel(int64_t now);
+    //添加节点，at为到期时间。节点若已在时间轮中，会先被移除
+    void add(TimerNode *node, int64_t at);
+    //移除节点，节点不在时间轮中时忽略
+    void remove(TimerNode *node);
+    //把所有at<=now的节点移到到期链表中，之后通过popExpired逐个取出
+    void expire(int64_t now);
+    //取出一个到期节点，没有则返回NULL。回调中可以安全地移除其他到期节点
+    TimerNode *popExpired();
+    //最近一个可能到期的时刻，用于计算poll的等待时间，为保守值，可能早于实际到期时刻
+    int64_t nearest() const { return nearest_; }
+    //nearest已过期时，重新扫描时间轮计算nearest
+    void refreshNearest();
+    size_t size() const { return size_; }
+
+   private:
+    enum {
+        kRootBits = 8,
+        kLevelBits = 6,
+        kRootSize = 1 << kRootBits,
+        kLevelSize = 1 << kLevelBits,
+        kLevels = 4,
+    };
+    TimerNode root_[kRootSize];
+    TimerNode levels_[kLevels][kLevelSize];
+    TimerNode expired_;
+    int64_t current_;  //下一个待处理的毫秒
+    int64_t nearest_;
+    size_t size_;
+    void place(TimerNode *node);
+    //下一个需要处理的毫秒：最近的非空槽，或者最近一次非空槽的层间下移
+    int64_t next() const;
+    void cascade(int level, int index);
+    static void init(TimerNode *head) { head->prev_ = head->next_ = head; }
+    static bool empty(const TimerNode *head) { return head->next_ == head; }
+    static void append(TimerNode *head, TimerNode *node);
+    static void unlink(TimerNode *node);
+    //把from中的所有节点移动到to的末尾
+    static void splice(TimerNode *to, TimerNode *from);
+};
+
+}  // namespace handy
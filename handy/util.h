@@ -42,4 +42,25 @@ struct ExitCaller : private noncopyable {
     std::function<void()> functor_;
 };
 
+//线程局部的缓存对象，第一次调用时创建，线程退出时释放，之后返回NULL
+//访问时只读取线程局部的指针，没有带构造函数的thread_local对象的初始化检查
+template <class T>
+T *threadCache() {
+    static thread_local T *cache;
+    static thread_local bool dead;
+    struct Guard {
+        ~Guard() {
+            delete cache;
+            cache = NULL;
+            dead = true;
+        }
+    };
+    if (cache == NULL && !dead) {
+        static thread_local Guard guard;
+        (void) guard;
+        cache = new T;
+    }
+    return cache;
+}
+
 }  // namespace handy
@@ -0,0 +1,211 @@
+#include "zlib_codec.h"
+
+#ifdef HANDY_ZLIB
+
+#include <zlib.h>
+#include <vector>
+#include "logging.h"
+#include "util.h"
+
+using namespace std;
+
+namespace handy {
+
+namespace {
+
+const char kRaw = 0, kDeflated = 1;
+// every sync flush ends with an empty stored block, it is dropped on the wire and added back before inflating
+const char kFlushTail[] = {0, 0, char(0xff), char(0xff)};
+const size_t kCachedContexts = 16;
+
+// contexts of closed connections, reset and kept for the next connections on this thread.
+// a deflate context holds about 256K, creating it for every short connection is costly
+struct ContextCache {
+    vector<pair<int, z_stream *>> deflaters;
+    vector<z_stream *> inflaters;
+    ~ContextCache() {
+        for (auto &d : deflaters) {
+            deflateEnd(d.second);
+            delete d.second;
+        }
+        for (z_stream *z : inflaters) {
+            inflateEnd(z);
+            delete z;
+        }
+    }
+};
+
+z_stream *newDeflater(int level, const string &dict) {
+    ContextCache *cache = threadCache<ContextCache>();
+    z_stream *z = NULL;
+    for (size_t i = 0; cache && i < cache->deflaters.size(); i++) {
+        if (cache->deflaters[i].first == level) {
+            z = cache->deflaters[i].second;
+            cache->deflaters.erase(cache->deflaters.begin() + i);
+            break;
+        }
+    }
+    if (z == NULL) {
+        z = new z_stream();
+        int r = deflateInit2(z, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+        fatalif(r != Z_OK, "deflateInit2 failed %d", r);
+    }
+    if (dict.size()) {
+        deflateSetDictionary(z, (const Bytef *) dict.data(), dict.size());
+    }
+    return z;
+}
+
+z_stream *newInflater(const string &dict) {
+    ContextCache *cache = threadCache<ContextCache>();
+    z_stream *z = NULL;
+    if (cache && cache->inflaters.size()) {
+        z = cache->inflaters.back();
+        cache->inflaters.pop_back();
+    } else {
+        z = new z_stream();
+        int r = inflateInit2(z, -15);
+        fatalif(r != Z_OK, "inflateInit2 failed %d", r);
+    }
+    if (dict.size()) {
+        inflateSetDictionary(z, (const Bytef *) dict.data(), dict.size());
+    }
+    return z;
+}
+
+void releaseDeflater(int level, z_stream *z) {
+    ContextCache *cache = threadCache<ContextCache>();
+    if (cache && cache->deflaters.size() < kCachedContexts) {
+        deflateReset(z);
+        cache->deflaters.push_back(make_pair(level, z));
+    } else {
+        deflateEnd(z);
+        delete z;
+    }
+}
+
+void releaseInflater(z_stream *z) {
+    ContextCache *cache = threadCache<ContextCache>();
+    if (cache && cache->inflaters.size() < kCachedContexts) {
+        inflateReset(z);
+        cache->inflaters.push_back(z);
+    } else {
+        inflateEnd(z);
+        delete z;
+    }
+}
+
+}  // namespace
+
+ZlibCodec::ZlibCodec(CodecBase *inner, size_t threshold, int level, const string &dict, size_t maxMsg)
+    : inner_(inner), threshold_(threshold), level_(level), dict_(dict), maxMsg_(maxMsg), deflater_(NULL), inflater_(NULL), used_(0), batchEnd_(false) {}
+
+ZlibCodec::~ZlibCodec() {
+    reset();
+}
+
+void ZlibCodec::reset() {
+    if (deflater_) {
+        releaseDeflater(level_, deflater_);
+        deflater_ = NULL;
+    }
+    if (inflater_) {
+        releaseInflater(inflater_);
+        inflater_ = NULL;
+    }
+    inner_->reset();
+    used_ = 0;
+    batchEnd_ = false;
+}
+
+CodecBase *ZlibCodec::clone() {
+    return new ZlibCodec(inner_->clone(), threshold_, level_, dict_, maxMsg_);
+}
+
+void ZlibCodec::encode(Slice msg, Buffer &buf) {
+    payload_.consume(payload_.size());
+    if (msg.size() < threshold_) {
+        payload_.append(&kRaw, 1).append(msg);
+        inner_->encode(payload_, buf);
+        return;
+    }
+    if (deflater_ == NULL) {
+        deflater_ = newDeflater(level_, dict_);
+    }
+    payload_.append(&kDeflated, 1);
+    z_stream *z = deflater_;
+    z->next_in = (Bytef *) msg.data();
+    z->avail_in = msg.size();
+    do {
+        char *p = payload_.makeRoom(msg.size() / 2 + 64);
+        size_t room = payload_.space();
+        z->next_out = (Bytef *) p;
+        z->avail_out = room;
+        int r = deflate(z, Z_SYNC_FLUSH);
+        fatalif(r != Z_OK && r != Z_BUF_ERROR, "deflate failed %d", r);
+        payload_.addSize(room - z->avail_out);
+    } while (z->avail_out == 0);
+    inner_->encode(Slice(payload_.data(), payload_.size() - sizeof kFlushTail), buf);
+}
+
+bool ZlibCodec::inflateTo(const char *p, size_t len, Buffer &out) {
+    z_stream *z = inflater_;
+    z->next_in = (Bytef *) p;
+    z->avail_in = len;
+    do {
+        char *o = out.makeRoom(max(len * 4, (size_t) 4096));
+        size_t room = out.space();
+        z->next_out = (Bytef *) o;
+        z->avail_out = room;
+        int r = inflate(z, Z_SYNC_FLUSH);
+        out.addSize(room - z->avail_out);
+        if ((r != Z_OK && r != Z_BUF_ERROR) || out.size() > maxMsg_) {
+            return false;
+        }
+        if (r == Z_BUF_ERROR && z->avail_in && z->avail_out) {
+            return false;
+        }
+    } while (z->avail_in || z->avail_out == 0);
+    return true;
+}
+
+int ZlibCodec::tryDecode(Slice data, Slice &msg) {
+    // the callers decode until 0 is returned, the messages of the last round are no longer referenced
+    if (batchEnd_) {
+        used_ = 0;
+        batchEnd_ = false;
+    }
+    Slice payload;
+    int r = inner_->tryDecode(data, payload);
+    if (r <= 0 || payload.empty()) {
+        batchEnd_ = true;
+        return r <= 0 ? r : -1;
+    }
+    char flag = payload[0];
+    payload.eat(1);
+    if (flag == kRaw) {
+        msg = payload;
+        return r;
+    }
+    if (flag != kDeflated) {
+        return -1;
+    }
+    if (inflater_ == NULL) {
+        inflater_ = newInflater(dict_);
+    }
+    if (used_ == outs_.size()) {
+        outs_.emplace_back();
+    }
+    Buffer &out = outs_[used_++];
+    out.consume(out.size());
+    if (!inflateTo(payload.data(), payload.size(), out) || !inflateTo(kFlushTail, sizeof kFlushTail, out)) {
+        error("inflate failed, msg len %lu", payload.size());
+        return -1;
+    }
+    msg = out;
+    return r;
+}
+
+}  // namespace handy
+
+#endif
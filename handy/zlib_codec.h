@@ -0,0 +1,45 @@
+#pragma once
+#include <deque>
+#include <memory>
+#include <string>
+#include "codec.h"
+
+struct z_stream_s;
+
+namespace handy {
+
+//压缩消息，包装其他codec：消息压缩后交给inner分帧，首字节标记是否压缩
+//每个连接有自己的压缩流，后面的消息可以引用前面消息中的内容，适合大量相似的消息，如json
+//需要以HANDY_ZLIB编译并链接zlib
+//有状态：每个消息只能解码一次，编码结果只能发给同一个连接，不能通过ChainBuffer广播
+//tryDecode返回的消息在下一次返回0之后的调用前有效，因此可以用于onMsgs
+struct ZlibCodec : public CodecBase {
+    // inner的所有权交给ZlibCodec
+    // threshold 小于此长度的消息不压缩，直接发送
+    // level 压缩级别，1最快，9压缩率最高
+    // dict 预置字典，放入常见的内容可以提高前几个消息的压缩率，两端必须相同
+    // maxMsg 解压后消息的最大长度，超过时解析出错
+    explicit ZlibCodec(CodecBase *inner, size_t threshold = 128, int level = 1, const std::string &dict = "", size_t maxMsg = 4 * 1024 * 1024);
+    ~ZlibCodec();
+    int tryDecode(Slice data, Slice &msg) override;
+    void encode(Slice msg, Buffer &buf) override;
+    CodecBase *clone() override;
+    //释放压缩与解压的上下文，新连接从新的压缩流开始
+    void reset() override;
+
+   private:
+    std::unique_ptr<CodecBase> inner_;
+    size_t threshold_;
+    int level_;
+    std::string dict_;
+    size_t maxMsg_;
+    // created on first use, returned to a per thread cache when the codec is destroyed
+    z_stream_s *deflater_, *inflater_;
+    Buffer payload_;
+    std::deque<Buffer> outs_;  //解压后的消息
+    size_t used_;
+    bool batchEnd_;
+    bool inflateTo(const char *p, size_t len, Buffer &out);
+};
+
+}  // namespace handy
@@ -1,5 +1,12 @@
 #include <handy/conn.h>
 #include <handy/logging.h>
+#include <handy/timer_wheel.h>
+#include <handy/zlib_codec.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <map>
+#include <mutex>
+#include <set>
 #include <thread>
 #include "test_harness.h"
 
@@ -25,6 +32,28 @@ TEST(test::TestBase, EventBase) {
     th.join();
 }
 
+TEST(test::TestBase, SafeCallBurst) {
+    EventBase base;
+    int called = 0;
+    vector<thread> ths;
+    for (int i = 0; i < 4; i++) {
+        ths.push_back(thread([&] {
+            for (int j = 0; j < 10000; j++) {
+                base.safeCall([&] {
+                    if (++called == 40000) {
+                        base.exit();
+                    }
+                });
+            }
+        }));
+    }
+    base.loop();
+    for (auto &t : ths) {
+        t.join();
+    }
+    ASSERT_EQ(40000, called);
+}
+
 TEST(test::TestBase, Timer) {
     EventBase base;
     long now = util::timeMilli();
@@ -85,4 +114,1175 @@ TEST(test::TestBase, kevent) {
         base.exit();
     });
     base.loop();
-}
\ No newline at end of file
+}
+TEST(test::TestBase, TimerWheel) {
+    int64_t now = 1000;
+    TimerWheel wheel(now);
+    vector<TimerNode> nodes(6);
+    int64_t delays[] = {0, 3, 300, 20000, 5000000, 1LL << 33};
+    for (size_t i = 0; i < nodes.size(); i++) {
+        wheel.add(&nodes[i], now + delays[i]);
+    }
+    ASSERT_EQ(now, wheel.nearest());
+    wheel.remove(&nodes[1]);
+    ASSERT_EQ(5u, wheel.size());
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (i == 1) {
+            continue;
+        }
+        wheel.expire(now + delays[i] - 1);
+        ASSERT_EQ((TimerNode *) NULL, wheel.popExpired());
+        wheel.refreshNearest();
+        ASSERT_LE(wheel.nearest(), now + delays[i]);
+        wheel.expire(now + delays[i]);
+        ASSERT_EQ(&nodes[i], wheel.popExpired());
+        ASSERT_EQ((TimerNode *) NULL, wheel.popExpired());
+    }
+    ASSERT_EQ(0u, wheel.size());
+}
+
+TEST(test::TestBase, TimerCancel) {
+    EventBase base;
+    int fired = 0;
+    TimerId once = base.runAfter(1, [&] { fired++; });
+    TimerId rep;
+    rep = base.runAfter(1, [&] {
+        if (++fired >= 3) {
+            ASSERT_EQ(true, base.cancel(rep));
+        }
+    }, 1);
+    base.runAfter(50, [&] { base.exit(); });
+    base.loop();
+    ASSERT_EQ(3, fired);
+    ASSERT_EQ(false, base.cancel(once));
+    ASSERT_EQ(false, base.cancel(rep));
+    ASSERT_EQ(false, base.cancel(TimerId()));
+}
+
+TEST(test::TestBase, IoUringEcho) {
+    EventBase base(0, PollerType::IoUring);
+    TcpServer echo(&base);
+    int r = echo.bind("", 2099);
+    ASSERT_EQ(r, 0);
+    echo.onConnRead([](const TcpConnPtr &con) { con->send(con->getInput()); });
+    string recved;
+    TcpConnPtr con = TcpConn::createConnection(&base, "127.0.0.1", 2099);
+    con->onState([](const TcpConnPtr &con) {
+        if (con->getState() == TcpConn::Connected)
+            con->send("hello");
+    });
+    con->onRead([&](const TcpConnPtr &con) {
+        recved.append(con->getInput().data(), con->getInput().size());
+        con->getInput().clear();
+        base.exit();
+    });
+    base.runAfter(3000, [&] { base.exit(); });
+    base.loop();
+    ASSERT_EQ("hello", recved);
+}
+
+// a subclass that does its I/O like TcpConn keeps the completion mode
+struct PlainConn : public TcpConn {};
+
+TEST(test::TestBase, IoUringCompletionEcho) {
+    EventBase base(0, PollerType::IoUringCompletion);
+    TcpServer echo(&base);
+    int r = echo.bind("", 2099);
+    ASSERT_EQ(r, 0);
+    // the watermark pauses the reads of the server while the client is slow to read
+    echo.onConnState([](const TcpConnPtr &con) {
+        if (con->getState() == TcpConn::Connected)
+            con->setWatermark(256 * 1024, 64 * 1024);
+    });
+    echo.onConnRead([](const TcpConnPtr &con) { con->send(con->getInput()); });
+    string sent, recved;
+    for (int i = 0; sent.size() < 4 * 1024 * 1024; i++) {
+        sent += util::format("%d,", i);
+    }
+    bool uring = false;
+    TcpConnPtr con = TcpConn::createConnection<PlainConn>(&base, "127.0.0.1", 2099);
+    con->onState([&](const TcpConnPtr &con) {
+        if (con->getState() == TcpConn::Connected) {
+            uring = con->uring_;
+            con->send(sent.substr(0, 1000));
+            Buffer rest;
+            rest.append(sent.data() + 1000, sent.size() - 1000);
+            con->send(rest);
+        }
+    });
+    con->onRead([&](const TcpConnPtr &con) {
+        recved.append(con->getInput().data(), con->getInput().size());
+        con->getInput().clear();
+        if (recved.size() == sent.size()) {
+            base.exit();
+        }
+    });
+    base.runAfter(5000, [&] { base.exit(); });
+    base.loop();
+    ASSERT_EQ(true, uring);
+    ASSERT_EQ(sent.size(), recved.size());
+    ASSERT_EQ(true, sent == recved);
+}
+
+TEST(test::TestBase, EdgeTriggeredEcho) {
+    EventBase base;
+    base.setEdgeTriggered(true);
+    TcpServer echo(&base);
+    int r = echo.bind("", 2099);
+    ASSERT_EQ(r, 0);
+    echo.onConnRead([](const TcpConnPtr &con) { con->send(con->getInput()); });
+    size_t total = 4 * 1024 * 1024, recved = 0;
+    TcpConnPtr con = TcpConn::createConnection(&base, "127.0.0.1", 2099);
+    con->onState([total](const TcpConnPtr &con) {
+        if (con->getState() == TcpConn::Connected)
+            con->send(string(total, 'a'));
+    });
+    con->onRead([&](const TcpConnPtr &con) {
+        recved += con->getInput().size();
+        con->getInput().clear();
+        if (recved == total) {
+            base.exit();
+        }
+    });
+    base.runAfter(5000, [&] { base.exit(); });
+    base.loop();
+    ASSERT_EQ(total, recved);
+}
+
+TEST(test::TestBase, StaleEvent) {
+    EventBase base;
+    int a[2], b[2], c[2];
+    ASSERT_EQ(0, pipe(a));
+    ASSERT_EQ(0, pipe(b));
+    ASSERT_EQ(1, write(a[1], "a", 1));
+    ASSERT_EQ(1, write(b[1], "b", 1));
+    Channel *chs[2] = {new Channel(&base, a[0], kReadEvent), new Channel(&base, b[0], kReadEvent)};
+    Channel *reused = NULL;
+    int handled = 0, stale = 0;
+    for (int i = 0; i < 2; i++) {
+        chs[i]->onRead([&, i] {
+            if (reused || chs[i]->fd() < 0) {
+                return;
+            }
+            handled++;
+            // both pipes are readable in the same batch, close the other one and reuse its fd
+            Channel *other = chs[1 - i];
+            int fd = other->fd();
+            delete other;
+            chs[1 - i] = NULL;
+            ASSERT_EQ(0, pipe(c));
+            ASSERT_EQ(fd, c[0]);
+            reused = new Channel(&base, c[0], kReadEvent);
+            reused->onRead([&] { stale += reused->fd() >= 0; });
+        });
+    }
+    base.loop_once(100);
+    ASSERT_EQ(1, handled);
+    ASSERT_EQ(0, stale);
+    delete reused;
+    delete chs[0];
+    delete chs[1];
+    ::close(a[1]);
+    ::close(b[1]);
+    ::close(c[1]);
+}
+
+TEST(test::TestBase, CachedNow) {
+    EventBase base;
+    int64_t start = base.preciseNow();
+    ASSERT_EQ(start, base.now());
+    usleep(20 * 1000);
+    ASSERT_EQ(start, base.now());
+    base.loop_once(0);
+    ASSERT_GE(base.now(), start + 20);
+    ASSERT_GE(base.preciseNow(), base.now());
+}
+
+TEST(test::TestBase, TimerAfterBusyCallback) {
+    EventBase base;
+    bool due = false, immediate = false;
+    base.runAfter(20, [&] { due = true; });
+    // the callbacks of one iteration take longer than the timer, both timers fire in the same iteration
+    base.safeCall([&] {
+        usleep(40 * 1000);
+        base.runAfter(0, [&] { immediate = true; });
+    });
+    base.loop_once(1000);
+    ASSERT_TRUE(due);
+    ASSERT_TRUE(immediate);
+}
+
+TEST(test::TestBase, IdleConn) {
+    EventBase base;
+    TcpServerPtr svr = TcpServer::startServer(&base, "127.0.0.1", 2099);
+    ASSERT_TRUE(svr != NULL);
+    int64_t start = util::timeMilli(), fired = 0;
+    svr->onConnState([&](const TcpConnPtr &con) {
+        if (con->getState() == TcpConn::Connected) {
+            con->addIdleCB(1, [&](const TcpConnPtr &con) {
+                fired = util::timeMilli() - start;
+                con->close();
+                base.exit();
+            });
+        }
+    });
+    svr->onConnRead([](const TcpConnPtr &con) { con->getInput().clear(); });
+    TcpConnPtr con = TcpConn::createConnection(&base, "127.0.0.1", 2099);
+    base.runAfter(600, [con] { con->send("hello"); });
+    base.runAfter(5000, [&] { base.exit(); });
+    base.loop();
+    // the read at 600ms postpones the idle callback to 1600ms
+    ASSERT_GE(fired, 1600);
+    ASSERT_LT(fired, 1800);
+}
+
+TEST(test::TestBase, IdleConnMilli) {
+    EventBase base;
+    TcpServerPtr svr = TcpServer::startServer(&base, "127.0.0.1", 2099);
+    ASSERT_TRUE(svr != NULL);
+    int64_t start = util::timeMilli(), fired = 0;
+    svr->onConnState([&](const TcpConnPtr &con) {
+        if (con->getState() == TcpConn::Connected) {
+            con->addIdleCBMilli(300, [&](const TcpConnPtr &con) {
+                fired = util::timeMilli() - start;
+                con->close();
+                base.exit();
+            });
+        }
+    });
+    TcpConnPtr con = TcpConn::createConnection(&base, "127.0.0.1", 2099);
+    base.runAfter(3000, [&] { base.exit(); });
+    base.loop();
+    ASSERT_GE(fired, 300);
+    ASSERT_LT(fired, 500);
+}
+
+TEST(test::TestBase, BasePolicy) {
+    MultiBase multi(4);
+    multi.setPolicy(BasePolicy::PeerHash);
+    EventBase *b = multi.allocBase(Ip4Addr("127.0.0.1", 1000));
+    for (int i = 1; i < 10; i++) {
+        ASSERT_TRUE(b == multi.allocBase(Ip4Addr("127.0.0.1", 1000 + i)));
+    }
+    // no load yet, ties are broken in round robin
+    multi.setPolicy(BasePolicy::LeastConns);
+    set<EventBase *> bases;
+    for (int i = 0; i < 4; i++) {
+        bases.insert(multi.allocBase());
+    }
+    ASSERT_EQ(4u, bases.size());
+
+    EventBase base;
+    TcpServerPtr svr = TcpServer::startServer(&base, "127.0.0.1", 2099);
+    ASSERT_TRUE(svr != NULL);
+    TcpConnPtr con = TcpConn::createConnection(&base, "127.0.0.1", 2099);
+    for (int i = 0; i < 100 && base.connCount() < 2; i++) {
+        base.loop_once(10);
+    }
+    ASSERT_EQ(2, base.connCount());
+    con->close();
+    for (int i = 0; i < 100 && base.connCount() > 0; i++) {
+        base.loop_once(10);
+    }
+    ASSERT_EQ(0, base.connCount());
+}
+
+TEST(test::TestBase, AcceptPerLoop) {
+    MultiBase multi(2);
+    TcpServerPtr svr = TcpServer::startServer(&multi, "127.0.0.1", 2099, false, true);
+    ASSERT_TRUE(svr != NULL);
+    mutex m;
+    set<EventBase *> used;
+    svr->onConnRead([&](const TcpConnPtr &con) {
+        {
+            lock_guard<mutex> lk(m);
+            used.insert(con->getBase());
+        }
+        con->send(con->getInput());
+    });
+    thread th([&] { multi.loop(); });
+    EventBase base;
+    int echoed = 0;
+    vector<TcpConnPtr> cons;
+    for (int i = 0; i < 20; i++) {
+        TcpConnPtr con = TcpConn::createConnection(&base, "127.0.0.1", 2099);
+        con->onState([](const TcpConnPtr &con) {
+            if (con->getState() == TcpConn::Connected) {
+                con->send("hello");
+            }
+        });
+        con->onRead([&](const TcpConnPtr &con) {
+            if (++echoed == 20) {
+                base.exit();
+            }
+        });
+        cons.push_back(con);
+    }
+    base.runAfter(3000, [&] { base.exit(); });
+    base.loop();
+    multi.exit();
+    th.join();
+    ASSERT_EQ(20, echoed);
+    // the kernel spreads the connections by hash, 20 connections on a single listener is very unlikely
+    ASSERT_EQ(2u, used.size());
+}
+
+TEST(test::TestBase, AcceptAddr) {
+    EventBase base;
+    TcpServer svr(&base);
+    svr.setBacklog(128);
+    svr.setDeferAccept(1);
+    ASSERT_EQ(0, svr.bind("127.0.0.1", 0));
+    ASSERT_NE(0, svr.getAddr().port());
+    string local, peer;
+    svr.onConnRead([&](const TcpConnPtr &con) {
+        local = con->local_.toString();
+        peer = con->peer_.toString();
+        con->getInput().clear();
+        base.exit();
+    });
+    // with TCP_DEFER_ACCEPT the connection is accepted after the data arrives
+    TcpConnPtr con = TcpConn::createConnection(&base, "127.0.0.1", svr.getAddr().port());
+    con->onState([](const TcpConnPtr &con) {
+        if (con->getState() == TcpConn::Connected) {
+            con->send("hello");
+        }
+    });
+    base.runAfter(3000, [&] { base.exit(); });
+    base.loop();
+    ASSERT_EQ(svr.getAddr().toString(), local);
+    ASSERT_EQ(con->local_.toString(), peer);
+}
+
+TEST(test::TestBase, MaxConns) {
+    EventBase base;
+    TcpServer svr(&base);
+    svr.setMaxConns(2);
+    ASSERT_EQ(0, svr.bind("127.0.0.1", 0));
+    vector<TcpConnPtr> cons;
+    for (int i = 0; i < 4; i++) {
+        cons.push_back(TcpConn::createConnection(&base, "127.0.0.1", svr.getAddr().port()));
+    }
+    TcpServerStatsPtr stats = svr.getStats();
+    for (int i = 0; i < 100 && stats->accepted + stats->rejected < 4; i++) {
+        base.loop_once(10);
+    }
+    ASSERT_EQ(2, stats->accepted);
+    ASSERT_EQ(2, stats->rejected);
+    ASSERT_EQ(2, stats->conns);
+    for (auto &con : cons) {
+        con->close();
+    }
+    for (int i = 0; i < 100 && stats->conns > 0; i++) {
+        base.loop_once(10);
+    }
+    ASSERT_EQ(0, stats->conns);
+}
+
+TEST(test::TestBase, AcceptEmfile) {
+    EventBase base;
+    TcpServer svr(&base);
+    ASSERT_EQ(0, svr.bind("127.0.0.1", 0));
+    vector<int> fds;
+    for (int i = 0; i < 3; i++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        ASSERT_EQ(0, connect(fd, (struct sockaddr *) &svr.getAddr().getAddr(), sizeof(struct sockaddr)));
+        fds.push_back(fd);
+    }
+    // no descriptor is left for accept
+    struct rlimit old, lim;
+    getrlimit(RLIMIT_NOFILE, &old);
+    int next = open("/dev/null", O_RDONLY);
+    close(next);
+    lim = old;
+    lim.rlim_cur = next;
+    setrlimit(RLIMIT_NOFILE, &lim);
+    base.loop_once(10);
+    setrlimit(RLIMIT_NOFILE, &old);
+    TcpServerStatsPtr stats = svr.getStats();
+    ASSERT_EQ(1, stats->rejected);
+    ASSERT_EQ(1, stats->paused);
+    ASSERT_EQ(0, stats->accepted);
+    // accepting resumes after the backoff
+    for (int i = 0; i < 100 && stats->accepted < 2; i++) {
+        base.loop_once(10);
+    }
+    ASSERT_EQ(2, stats->accepted);
+    for (int fd : fds) {
+        close(fd);
+    }
+}
+
+TEST(test::TestBase, OutputQueue) {
+    EventBase base;
+    TcpServer svr(&base);
+    ASSERT_EQ(0, svr.bind("127.0.0.1", 0));
+    vector<string> got;
+    svr.onConnMsg(new LengthCodec, [&](const TcpConnPtr &con, Slice msg) { got.push_back(msg); });
+    // large messages are queued without copying once the socket buffer is full, small ones are coalesced
+    vector<string> sent;
+    for (int i = 0; i < 200; i++) {
+        sent.push_back(string(i % 2 ? 100 * 1000 : i, 'a' + i % 26));
+    }
+    size_t queued = 0;
+    TcpConnPtr con = TcpConn::createConnection(&base, "127.0.0.1", svr.getAddr().port());
+    con->onMsg(new LengthCodec, [](const TcpConnPtr &con, Slice msg) {});
+    con->onState([&](const TcpConnPtr &con) {
+        if (con->getState() != TcpConn::Connected) {
+            return;
+        }
+        for (size_t i = 0; i < sent.size(); i++) {
+            if (i % 4 == 1) {
+                Buffer msg;
+                msg.append(sent[i]);
+                con->sendMsg(msg);
+                ASSERT_EQ(0u, msg.size());
+            } else {
+                con->sendMsg(sent[i]);
+            }
+        }
+        queued = con->outq_.size();
+    });
+    for (int i = 0; i < 1000 && got.size() < sent.size(); i++) {
+        base.loop_once(10);
+    }
+    ASSERT_EQ(sent.size(), got.size());
+    for (size_t i = 0; i < sent.size(); i++) {
+        ASSERT_EQ(sent[i], got[i]);
+    }
+    ASSERT_TRUE(queued > 0);
+    ASSERT_TRUE(con->outq_.empty());
+}
+
+// a connection that scrambles its data in readImp and writeImp, the data read by readv and sent by writev must
+// go through them
+struct XorConn : public TcpConn {
+    bool rawSocketIo() override { return false; }
+    int readImp(int fd, void *buf, size_t bytes) override {
+        int rd = ::read(fd, buf, bytes);
+        for (int i = 0; i < rd; i++) {
+            ((char *) buf)[i] ^= 0x5a;
+        }
+        return rd;
+    }
+    int writeImp(int fd, const void *buf, size_t bytes) override {
+        string out((const char *) buf, bytes);
+        for (char &c : out) {
+            c ^= 0x5a;
+        }
+        return ::write(fd, out.data(), out.size());
+    }
+};
+
+TEST(test::TestBase, WriteImp) {
+    EventBase base;
+    TcpServer svr(&base);
+    ASSERT_EQ(0, svr.bind("127.0.0.1", 0));
+    string raw;
+    svr.onConnRead([&](const TcpConnPtr &con) {
+        raw.append(con->getInput().data(), con->getInput().size());
+        con->getInput().clear();
+    });
+    vector<string> sent = {"hello", string(300 * 1000, 'a'), "", string(200 * 1000, 'b'), "chain"};
+    TcpConnPtr con = TcpConn::createConnection<XorConn>(&base, "127.0.0.1", svr.getAddr().port());
+    con->onMsg(new LengthCodec, [](const TcpConnPtr &con, Slice msg) {});
+    con->onState([&](const TcpConnPtr &con) {
+        if (con->getState() != TcpConn::Connected) {
+            return;
+        }
+        con->sendMsg(sent[0]);
+        Buffer msg;
+        msg.append(sent[1]);
+        con->sendMsg(msg);
+        con->sendMsg(sent[2]);
+        con->sendMsg(sent[3]);
+        Buffer chain;
+        LengthCodec().encode(sent[4], chain);
+        con->send(ChainBuffer(Slice(chain)));
+    });
+    size_t total = 0;
+    for (auto &m : sent) {
+        total += m.size() + 8;
+    }
+    for (int i = 0; i < 1000 && raw.size() < total; i++) {
+        base.loop_once(10);
+    }
+    ASSERT_EQ(total, raw.size());
+    for (char &c : raw) {
+        c ^= 0x5a;
+    }
+    LengthCodec codec;
+    Slice data(raw);
+    for (auto &m : sent) {
+        Slice got;
+        int r = codec.tryDecode(data, got);
+        ASSERT_TRUE(r > 0);
+        ASSERT_EQ(m, got.toString());
+        data.eat(r);
+    }
+}
+
+TEST(test::TestBase, ReadImp) {
+    EventBase base;
+    TcpServer svr(&base);
+    ASSERT_EQ(0, svr.bind("127.0.0.1", 0));
+    svr.onConnCreate([] { return TcpConnPtr(new XorConn); });
+    svr.onConnMsg(new LengthCodec, [](const TcpConnPtr &con, Slice msg) { con->sendMsg(msg); });
+    // large messages spill over the input buffer within one read event
+    vector<string> sent = {"hello", string(500 * 1000, 'a'), "world"};
+    vector<string> got;
+    TcpConnPtr con = TcpConn::createConnection<XorConn>(&base, "127.0.0.1", svr.getAddr().port());
+    con->onMsg(new LengthCodec, [&](const TcpConnPtr &con, Slice msg) { got.push_back(msg); });
+    con->onState([&](const TcpConnPtr &con) {
+        if (con->getState() == TcpConn::Connected) {
+            for (auto &m : sent) {
+                con->sendMsg(m);
+            }
+        }
+    });
+    for (int i = 0; i < 1000 && got.size() < sent.size(); i++) {
+        base.loop_once(10);
+    }
+    ASSERT_TRUE(got == sent);
+}
+
+TEST(test::TestBase, ChainBuffer) {
+    ChainBuffer buf;
+    buf.append("hello ").append(string(5000, 'x'));
+    ASSERT_EQ(5006u, buf.size());
+    ASSERT_EQ(2u, buf.pieces().size());
+    // copies share the blocks, appending after sharing goes to a new block
+    ChainBuffer copy = buf;
+    ASSERT_EQ(buf.pieces()[0].data.data(), copy.pieces()[0].data.data());
+    copy.append("!");
+    ASSERT_EQ(3u, copy.pieces().size());
+    ASSERT_EQ(5006u, buf.size());
+    ASSERT_EQ("hello " + string(5000, 'x') + "!", copy.toString());
+    ASSERT_EQ("lo xx", copy.sub(3, 5).toString());
+    copy.consume(5004);
+    ASSERT_EQ("xx!", copy.toString());
+    copy.append(copy);
+    ASSERT_EQ("xx!xx!", copy.toString());
+    Buffer b;
+    b.append("abc");
+    const char *p = b.data();
+    copy.absorb(b);
+    ASSERT_EQ(0u, b.size());
+    ASSERT_EQ(p, copy.pieces().back().data.data());
+    copy.copyTo(b);
+    ASSERT_EQ(string("xx!xx!abc"), string(b.data(), b.size()));
+
+    LengthCodec codec;
+    ChainBuffer msg;
+    msg.appendMsg(&codec, buf);
+    Slice decoded;
+    string encoded = msg.toString();
+    ASSERT_EQ((int) encoded.size(), codec.tryDecode(encoded, decoded));
+    ASSERT_EQ(buf.toString(), decoded.toString());
+}
+
+TEST(test::TestBase, ChainFanout) {
+    EventBase base;
+    TcpServer svr(&base);
+    ASSERT_EQ(0, svr.bind("127.0.0.1", 0));
+    vector<TcpConnPtr> svrCons;
+    svr.onConnState([&](const TcpConnPtr &con) {
+        if (con->getState() == TcpConn::Connected) {
+            svrCons.push_back(con);
+        }
+    });
+    svr.onConnRead([](const TcpConnPtr &con) {});
+    vector<TcpConnPtr> cons;
+    map<TcpConn *, vector<string>> got;
+    for (int i = 0; i < 4; i++) {
+        TcpConnPtr con = TcpConn::createConnection(&base, "127.0.0.1", svr.getAddr().port());
+        con->onMsg(new LineCodec, [&](const TcpConnPtr &con, Slice msg) { got[con.get()].push_back(msg); });
+        cons.push_back(con);
+    }
+    for (int i = 0; i < 100 && svrCons.size() < cons.size(); i++) {
+        base.loop_once(10);
+    }
+    ASSERT_EQ(cons.size(), svrCons.size());
+    LineCodec codec;
+    vector<string> sent;
+    for (int i = 0; i < 50; i++) {
+        sent.push_back(string(i % 5 ? 10 : 300 * 1000, 'a' + i % 26));
+        ChainBuffer msg;
+        msg.appendMsg(&codec, sent.back());
+        for (auto &con : svrCons) {
+            con->send(msg);
+        }
+    }
+    // a Slice is sent as a copy, it does not convert to a ChainBuffer
+    sent.push_back("slice");
+    string line = sent.back() + "\r\n";
+    for (auto &con : svrCons) {
+        con->send(Slice(line));
+    }
+    for (int i = 0; i < 1000; i++) {
+        size_t n = 0;
+        for (auto &g : got) {
+            n += g.second.size();
+        }
+        if (n == sent.size() * cons.size()) {
+            break;
+        }
+        base.loop_once(10);
+    }
+    ASSERT_EQ(cons.size(), got.size());
+    for (auto &g : got) {
+        ASSERT_TRUE(g.second == sent);
+    }
+}
+
+TEST(test::TestBase, BufferPool) {
+    BufferPool::Stats st0 = BufferPool::stats();
+    {
+        Buffer b;
+        b.append("hello");
+        b.consume(5);  // the block goes back to the pool
+        b.append("world");
+        // a small buffer takes a small block
+        ASSERT_EQ(512u, b.capacity());
+        Buffer big;
+        big.append(string(100 * 1000, 'a'));
+    }
+    BufferPool::Stats st1 = BufferPool::stats();
+    ASSERT_TRUE(st1.hits >= st0.hits + 1);
+    ASSERT_TRUE(st1.cached >= 512u);
+    // nothing is cached above the limit
+    BufferPool::setLimit(0);
+    {
+        Buffer b;
+        b.append("hello");
+    }
+    BufferPool::Stats st2 = BufferPool::stats();
+    ASSERT_EQ(st1.cached - 512, st2.cached);
+    BufferPool::setLimit(16 << 20);
+}
+
+TEST(test::TestBase, ReadSpill) {
+    EventBase base;
+    TcpServer svr(&base);
+    ASSERT_EQ(0, svr.bind("127.0.0.1", 0));
+    string got;
+    size_t space = 1;
+    svr.onConnRead([&](const TcpConnPtr &con) {
+        got.append(con->getInput().data(), con->getInput().size());
+        con->getInput().consume(con->getInput().size());
+        space = con->getInput().space();
+    });
+    string sent(500 * 1000, 0);
+    for (size_t i = 0; i < sent.size(); i++) {
+        sent[i] = 'a' + i % 26;
+    }
+    TcpConnPtr con = TcpConn::createConnection(&base, "127.0.0.1", svr.getAddr().port());
+    con->onState([&](const TcpConnPtr &con) {
+        if (con->getState() == TcpConn::Connected) {
+            con->send(sent);
+        }
+    });
+    for (int i = 0; i < 1000 && got.size() < sent.size(); i++) {
+        base.loop_once(10);
+    }
+    ASSERT_TRUE(got == sent);
+    // a consumed input keeps no memory
+    ASSERT_EQ(0u, space);
+}
+
+TEST(test::TestBase, Watermark) {
+    for (bool et : {false, true}) {
+        EventBase base;
+        base.setEdgeTriggered(et);
+        TcpServer svr(&base);
+        ASSERT_EQ(0, svr.bind("127.0.0.1", 0));
+        TcpConnPtr svrCon;
+        int highs = 0, lows = 0;
+        size_t maxOutput = 0;
+        svr.onConnState([&](const TcpConnPtr &con) {
+            if (con->getState() == TcpConn::Connected) {
+                svrCon = con;
+                con->setWatermark(
+                    256 * 1024, 64 * 1024, true, [&](const TcpConnPtr &) { highs++; }, [&](const TcpConnPtr &) { lows++; });
+            }
+        });
+        svr.onConnRead([&](const TcpConnPtr &con) {
+            con->send(con->getInput());
+            maxOutput = max(maxOutput, con->outputSize());
+        });
+        string sent(16 * 1024 * 1024, 'x'), got;
+        TcpConnPtr con = TcpConn::createConnection(&base, "127.0.0.1", svr.getAddr().port());
+        con->onRead([&](const TcpConnPtr &con) {
+            got.append(con->getInput().data(), con->getInput().size());
+            con->getInput().clear();
+        });
+        con->onState([&](const TcpConnPtr &con) {
+            if (con->getState() == TcpConn::Connected) {
+                // a slow client, it does not read until the server is paused
+                con->pauseRead(true);
+                con->send(sent);
+            }
+        });
+        for (int i = 0; i < 1000 && !(svrCon && svrCon->readPaused()); i++) {
+            base.loop_once(10);
+        }
+        ASSERT_TRUE(svrCon && svrCon->readPaused());
+        for (int i = 0; i < 20; i++) {
+            base.loop_once(10);
+        }
+        ASSERT_TRUE(svrCon->readPaused());
+        ASSERT_EQ(1, highs);
+        con->pauseRead(false);
+        for (int i = 0; i < 2000 && got.size() < sent.size(); i++) {
+            base.loop_once(10);
+        }
+        ASSERT_TRUE(got == sent);
+        ASSERT_FALSE(svrCon->readPaused());
+        ASSERT_TRUE(lows >= 1);
+        // input is delivered at the high mark, so the output stays within a few high marks
+        ASSERT_TRUE(maxOutput < 3 * 256 * 1024);
+    }
+}
+
+TEST(test::TestBase, AdaptiveInput) {
+    Buffer b;
+    b.append(string(50000, 'a'));
+    ASSERT_EQ(65536u, b.capacity());
+    b.consume(49990);
+    b.shrink(100);
+    ASSERT_EQ(512u, b.capacity());
+    ASSERT_EQ(string(10, 'a'), string(b.data(), b.size()));
+
+    EventBase base;
+    TcpServer svr(&base);
+    ASSERT_EQ(0, svr.bind("127.0.0.1", 0));
+    TcpConnPtr svrCon;
+    size_t got = 0;
+    svr.onConnState([&](const TcpConnPtr &con) { svrCon = con; });
+    svr.onConnRead([&](const TcpConnPtr &con) {
+        got += con->getInput().size();
+        con->getInput().clear();
+    });
+    TcpConnPtr con = TcpConn::createConnection(&base, "127.0.0.1", svr.getAddr().port());
+    string chunk(200 * 1000, 'b');
+    con->onState([&](const TcpConnPtr &con) {
+        if (con->getState() == TcpConn::Connected) {
+            for (int i = 0; i < 20; i++) {
+                con->send(chunk);
+            }
+        }
+    });
+    for (int i = 0; i < 1000 && got < 20 * chunk.size(); i++) {
+        base.loop_once(10);
+    }
+    ASSERT_EQ(20 * chunk.size(), got);
+    // a bulk stream learns a large read size
+    ASSERT_TRUE(svrCon->readAvg_ > 4096);
+}
+
+TEST(test::TestBase, ReadBudget) {
+    for (bool et : {false, true}) {
+        EventBase base;
+        base.setEdgeTriggered(et);
+        base.setReadBudget(32 * 1024);
+        TcpServer svr(&base);
+        ASSERT_EQ(0, svr.bind("127.0.0.1", 0));
+        string got;
+        size_t maxRead = 0;
+        svr.onConnRead([&](const TcpConnPtr &con) {
+            maxRead = max(maxRead, con->getInput().size());
+            got.append(con->getInput().data(), con->getInput().size());
+            con->getInput().clear();
+        });
+        string sent(4 * 1024 * 1024, 0);
+        for (size_t i = 0; i < sent.size(); i++) {
+            sent[i] = 'a' + i % 26;
+        }
+        TcpConnPtr con = TcpConn::createConnection(&base, "127.0.0.1", svr.getAddr().port());
+        con->onState([&](const TcpConnPtr &con) {
+            if (con->getState() == TcpConn::Connected) {
+                con->send(sent);
+            }
+        });
+        for (int i = 0; i < 2000 && got.size() < sent.size(); i++) {
+            base.loop_once(10);
+        }
+        ASSERT_TRUE(got == sent);
+        // one read event stops at the first readv past the budget
+        ASSERT_TRUE(maxRead <= 32 * 1024 + 2 * 65536);
+    }
+}
+
+TEST(test::TestBase, LineCodec) {
+    LineCodec codec(16);
+    Slice msg;
+    string data = "hello";
+    ASSERT_EQ(0, codec.tryDecode(data, msg));
+    data += " world\r\nnext";
+    ASSERT_EQ(13, codec.tryDecode(data, msg));
+    ASSERT_EQ("hello world", msg.toString());
+    data = data.substr(13);
+    ASSERT_EQ(0, codec.tryDecode(data, msg));
+    data += "\n";
+    ASSERT_EQ(5, codec.tryDecode(data, msg));
+    ASSERT_EQ("next", msg.toString());
+    // a line longer than the limit is rejected without waiting for the newline
+    ASSERT_EQ(0, codec.tryDecode(string(16, 'a'), msg));
+    ASSERT_TRUE(codec.tryDecode(string(17, 'a'), msg) < 0);
+    LineCodec unlimited;
+    ASSERT_EQ(0, unlimited.tryDecode(string(2 * 1024 * 1024, 'a'), msg));
+}
+
+TEST(test::TestBase, LineCodecReconnect) {
+    EventBase base;
+    TcpServer svr(&base);
+    ASSERT_EQ(0, svr.bind("127.0.0.1", 0));
+    int accepted = 0;
+    svr.onConnState([&](const TcpConnPtr &con) {
+        if (con->getState() == TcpConn::Connected) {
+            if (++accepted == 1) {
+                con->send("abcdefgh");
+                con->close();
+            } else {
+                con->send("x\r\n" + string(20, 'y'));
+            }
+        }
+    });
+    vector<string> got;
+    int connects = 0;
+    TcpConnPtr con = TcpConn::createConnection(&base, "127.0.0.1", svr.getAddr().port());
+    con->setReconnectInterval(0);
+    // the template onMsg keeps the scanned length in its codec, it must be reset with the connection
+    con->onMsg(LineCodec(), [&](const TcpConnPtr &con, Slice msg) { got.push_back(msg); });
+    con->onState([&](const TcpConnPtr &con) {
+        if (con->getState() == TcpConn::Connected) {
+            if (++connects == 2) {
+                con->setReconnectInterval(-1);
+            }
+        } else if (con->getState() == TcpConn::Closed) {
+            // the partial line of the last connection is dropped
+            con->getInput().clear();
+        }
+    });
+    for (int i = 0; i < 200 && got.empty(); i++) {
+        base.loop_once(10);
+    }
+    ASSERT_EQ(2, connects);
+    ASSERT_EQ(1u, got.size());
+    ASSERT_EQ("x", got[0]);
+}
+
+TEST(test::TestBase, BatchMsgs) {
+    EventBase base;
+    TcpServer svr(&base);
+    ASSERT_EQ(0, svr.bind("127.0.0.1", 0));
+    vector<string> got;
+    int batches = 0;
+    svr.onConnMsgs(new LengthCodec, [&](const TcpConnPtr &con, const vector<Slice> &msgs) {
+        batches++;
+        for (auto &msg : msgs) {
+            got.push_back(msg);
+        }
+    });
+    // a pipelining client, all requests go out in one write
+    LengthCodec codec;
+    Buffer req;
+    vector<string> sent;
+    for (int i = 0; i < 100; i++) {
+        sent.push_back(util::format("req %d", i));
+        codec.encode(sent.back(), req);
+    }
+    TcpConnPtr con = TcpConn::createConnection(&base, "127.0.0.1", svr.getAddr().port());
+    con->onState([&](const TcpConnPtr &con) {
+        if (con->getState() == TcpConn::Connected) {
+            con->send(req);
+        }
+    });
+    for (int i = 0; i < 100 && got.size() < sent.size(); i++) {
+        base.loop_once(10);
+    }
+    ASSERT_TRUE(got == sent);
+    ASSERT_TRUE(batches < 10);
+}
+
+TEST(test::TestBase, BatchMsgsBadFrame) {
+    EventBase base;
+    TcpServer svr(&base);
+    ASSERT_EQ(0, svr.bind("127.0.0.1", 0));
+    vector<string> got;
+    svr.onConnMsgs(new LengthCodec, [&](const TcpConnPtr &con, const vector<Slice> &msgs) {
+        for (auto &msg : msgs) {
+            got.push_back(msg);
+        }
+    });
+    // the good frame is delivered, then the garbage closes the connection
+    Buffer req;
+    LengthCodec().encode("good", req);
+    req.append("garbage!");
+    bool closed = false;
+    TcpConnPtr con = TcpConn::createConnection(&base, "127.0.0.1", svr.getAddr().port());
+    con->onState([&](const TcpConnPtr &con) {
+        if (con->getState() == TcpConn::Connected) {
+            con->send(req);
+        } else if (con->getState() == TcpConn::Closed) {
+            closed = true;
+        }
+    });
+    con->onRead([](const TcpConnPtr &con) { con->getInput().clear(); });
+    for (int i = 0; i < 100 && !closed; i++) {
+        base.loop_once(10);
+    }
+    ASSERT_TRUE(closed);
+    ASSERT_EQ(1, (int) got.size());
+    ASSERT_EQ("good", got[0]);
+}
+
+TEST(test::TestBase, FrameCodec) {
+    ASSERT_EQ(0xE3069283u, crc32c(0, "123456789", 9));
+    ASSERT_EQ(crc32c(0, "123456789", 9), crc32c(crc32c(0, "1234", 4), "56789", 5));
+    // the same format as LengthCodec
+    FrameCodec<FixedLen<4>, Magic<'m', 'B', 'd', 'T'>> same;
+    Buffer a, b;
+    same.encode("hello", a);
+    LengthCodec().encode("hello", b);
+    ASSERT_EQ(Slice(b).toString(), Slice(a).toString());
+    Slice msg;
+    ASSERT_EQ(13, LengthCodec().tryDecode(a, msg));
+    ASSERT_EQ("hello", msg.toString());
+
+    typedef FrameCodec<VarintLen, NoMagic, Crc32cCheck<Endian::Little>, 1024> Varint;
+    Varint codec;
+    string big(300, 'x');
+    Buffer buf;
+    codec.encode(big, buf);
+    ASSERT_EQ(2 + 300 + 4, (int) buf.size());
+    for (size_t i = 0; i < buf.size(); i++) {
+        ASSERT_EQ(0, codec.tryDecode(Slice(buf.data(), i), msg));
+    }
+    ASSERT_EQ((int) buf.size(), codec.tryDecode(buf, msg));
+    ASSERT_EQ(big, msg.toString());
+    buf.data()[100] ^= 1;
+    ASSERT_TRUE(codec.tryDecode(buf, msg) < 0);
+    // an oversize msg is not encoded, and rejected when it comes from a peer allowing more
+    buf.clear();
+    string over(1025, 'x');
+    codec.encode(over, buf);
+    ASSERT_EQ(0u, buf.size());
+    CodecFrame frame;
+    ASSERT_FALSE(codec.encodeFrame(over, frame));
+    FrameCodec<VarintLen, NoMagic, Crc32cCheck<Endian::Little>, 2048>().encode(over, buf);
+    ASSERT_TRUE(codec.tryDecode(buf, msg) < 0);
+
+    // a 2 byte length carries at most 65535 bytes, a larger MaxLen does not compile
+    FrameCodec<FixedLen<2, Endian::Little>, NoMagic, NoCheck, 65535> le;
+    buf.clear();
+    le.encode("ab", buf);
+    ASSERT_EQ(string("\x02\x00" "ab", 4), Slice(buf).toString());
+    // the runtime adaptor produces the same frames
+    CodecAdaptor<Varint> adaptor;
+    Buffer c;
+    adaptor.encode(big, c);
+    ASSERT_TRUE(adaptor.encodeFrame(big, frame));
+    ASSERT_EQ(c.size(), frame.headLen + big.size() + frame.tailLen);
+}
+
+TEST(test::TestBase, FrameCodecConn) {
+    typedef FrameCodec<VarintLen, Magic<'h', 'y'>, Crc32cCheck<>> Codec;
+    EventBase base;
+    TcpServer svr(&base);
+    ASSERT_EQ(0, svr.bind("127.0.0.1", 0));
+    svr.onConnMsg(Codec(), [](const TcpConnPtr &con, Slice msg) { con->sendMsg(msg); });
+    vector<string> got;
+    TcpConnPtr con = TcpConn::createConnection(&base, "127.0.0.1", svr.getAddr().port());
+    con->onMsg(Codec(), [&](const TcpConnPtr &con, Slice msg) { got.push_back(msg); });
+    con->onState([&](const TcpConnPtr &con) {
+        if (con->getState() == TcpConn::Connected) {
+            con->sendMsg("hello");
+            con->sendMsg(string(100000, 'a'));
+        }
+    });
+    for (int i = 0; i < 100 && got.size() < 2; i++) {
+        base.loop_once(10);
+    }
+    ASSERT_EQ(2, (int) got.size());
+    ASSERT_EQ("hello", got[0]);
+    ASSERT_EQ(string(100000, 'a'), got[1]);
+}
+
+TEST(test::TestBase, FrameCodecClose) {
+    typedef FrameCodec<VarintLen, Magic<'h', 'y'>> Codec;
+    EventBase base;
+    TcpServer svr(&base);
+    ASSERT_EQ(0, svr.bind("127.0.0.1", 0));
+    // closing from the callback while pipelined msgs remain, the closure decoding them is destroyed meanwhile
+    int got = 0;
+    svr.onConnMsg(Codec(), [&](const TcpConnPtr &con, Slice msg) {
+        got++;
+        con->closeNow();
+    });
+    Buffer req;
+    for (int i = 0; i < 10; i++) {
+        Codec().encode("msg", req);
+    }
+    bool closed = false;
+    TcpConnPtr con = TcpConn::createConnection(&base, "127.0.0.1", svr.getAddr().port());
+    con->onState([&](const TcpConnPtr &con) {
+        if (con->getState() == TcpConn::Connected) {
+            con->send(req);
+        } else if (con->getState() == TcpConn::Closed) {
+            closed = true;
+        }
+    });
+    con->onRead([](const TcpConnPtr &con) { con->getInput().clear(); });
+    for (int i = 0; i < 100 && !closed; i++) {
+        base.loop_once(10);
+    }
+    ASSERT_TRUE(closed);
+    ASSERT_TRUE(got > 0);
+}
+
+TEST(test::TestBase, CrcLengthCodec) {
+    string data;
+    for (int i = 0; i < 300; i++) {
+        data.push_back(char(i * 131 + 7));
+    }
+    // every length and alignment agrees with the portable tables
+    for (size_t off = 0; off < 8; off++) {
+        for (size_t len = 0; off + len <= data.size(); len++) {
+            ASSERT_EQ(crc32cPortable(5, data.data() + off, len), crc32c(5, data.data() + off, len));
+        }
+    }
+    unique_ptr<CodecBase> codec(new CrcLengthCodec);
+    Buffer buf;
+    codec->encode(data, buf);
+    CodecFrame frame;
+    ASSERT_TRUE(codec->encodeFrame(data, frame));
+    ASSERT_EQ(Slice(buf.data(), frame.headLen).toString(), string(frame.head, frame.headLen));
+    ASSERT_EQ(Slice(buf.end() - 4, 4).toString(), string(frame.tail, frame.tailLen));
+    Slice msg;
+    ASSERT_EQ((int) buf.size(), codec->tryDecode(buf, msg));
+    ASSERT_EQ(data, msg.toString());
+    // a flipped bit anywhere in the frame is detected
+    for (size_t i = 0; i < buf.size(); i += 7) {
+        buf.data()[i] ^= 0x10;
+        ASSERT_TRUE(codec->tryDecode(buf, msg) <= 0);
+        buf.data()[i] ^= 0x10;
+    }
+    // LengthCodec frames are refused
+    buf.clear();
+    LengthCodec().encode(data, buf);
+    ASSERT_TRUE(codec->tryDecode(buf, msg) < 0);
+}
+
+#ifdef HANDY_ZLIB
+TEST(test::TestBase, ZlibCodec) {
+    ZlibCodec sender(new LengthCodec, 64), receiver(new LengthCodec, 64);
+    vector<string> msgs;
+    for (int i = 0; i < 100; i++) {
+        msgs.push_back(i % 10 ? util::format("{\"id\":%d,\"name\":\"user %d\",\"status\":\"active\",\"tags\":[\"a\",\"b\"]}", i, i) : "short");
+    }
+    msgs.push_back(string(1024 * 1024, 'x'));
+    Buffer wire;
+    size_t raw = 0;
+    for (auto &m : msgs) {
+        sender.encode(m, wire);
+        raw += m.size();
+    }
+    ASSERT_TRUE(wire.size() < raw / 10);
+    // all the messages of one round stay valid until a call returns 0
+    vector<Slice> got;
+    Slice data = wire, msg;
+    int r;
+    while ((r = receiver.tryDecode(data, msg)) > 0) {
+        got.push_back(msg);
+        data.eat(r);
+    }
+    ASSERT_EQ(0, r);
+    ASSERT_EQ(msgs.size(), got.size());
+    for (size_t i = 0; i < msgs.size(); i++) {
+        ASSERT_EQ(msgs[i], got[i].toString());
+    }
+    // too long after decompression
+    ZlibCodec small(new LengthCodec, 64, 1, "", 1024);
+    ZlibCodec big(new LengthCodec);
+    Buffer buf;
+    big.encode(string(2048, 'a'), buf);
+    ASSERT_TRUE(small.tryDecode(buf, msg) < 0);
+    // a corrupted stream is reported as a decode error, the first deflate block gets the invalid type 3
+    unique_ptr<CodecBase> a(big.clone()), b(big.clone());
+    buf.clear();
+    a->encode(msgs[1] + msgs[2] + msgs[3], buf);
+    ASSERT_EQ(1, (int) buf.data()[8]);
+    buf.data()[9] |= 0x06;
+    ASSERT_TRUE(b->tryDecode(buf, msg) < 0);
+}
+
+TEST(test::TestBase, ZlibCodecConn) {
+    EventBase base;
+    TcpServer svr(&base);
+    ASSERT_EQ(0, svr.bind("127.0.0.1", 0));
+    svr.onConnMsg(new ZlibCodec(new LengthCodec), [](const TcpConnPtr &con, Slice msg) { con->sendMsg(msg); });
+    vector<string> sent, got;
+    for (int i = 0; i < 50; i++) {
+        sent.push_back(util::format("{\"seq\":%d,\"payload\":\"%s\"}", i, string(i * 40, 'p').c_str()));
+    }
+    TcpConnPtr con = TcpConn::createConnection(&base, "127.0.0.1", svr.getAddr().port());
+    con->onMsgs(new ZlibCodec(new LengthCodec), [&](const TcpConnPtr &con, const vector<Slice> &msgs) {
+        for (auto &m : msgs) {
+            got.push_back(m);
+        }
+    });
+    con->onState([&](const TcpConnPtr &con) {
+        if (con->getState() == TcpConn::Connected) {
+            for (auto &m : sent) {
+                con->sendMsg(m);
+            }
+        }
+    });
+    for (int i = 0; i < 100 && got.size() < sent.size(); i++) {
+        base.loop_once(10);
+    }
+    ASSERT_TRUE(got == sent);
+}
+
+TEST(test::TestBase, ZlibCodecReconnect) {
+    EventBase base;
+    TcpServer svr(&base);
+    ASSERT_EQ(0, svr.bind("127.0.0.1", 0));
+    vector<string> got;
+    svr.onConnMsg(new ZlibCodec(new LengthCodec), [&](const TcpConnPtr &con, Slice msg) {
+        got.push_back(msg);
+        if (msg == "bye") {
+            con->close();
+        }
+    });
+    vector<string> sent;
+    for (int i = 0; i < 20; i++) {
+        sent.push_back(util::format("{\"seq\":%d,\"payload\":\"%s\"}", i, string(200, 'p').c_str()));
+    }
+    sent.push_back("bye");
+    // the server gets a fresh codec for the new connection, the client starts a new stream as well
+    int connects = 0;
+    TcpConnPtr con = TcpConn::createConnection(&base, "127.0.0.1", svr.getAddr().port());
+    con->setReconnectInterval(0);
+    con->onMsg(new ZlibCodec(new LengthCodec), [](const TcpConnPtr &con, Slice msg) {});
+    con->onState([&](const TcpConnPtr &con) {
+        if (con->getState() == TcpConn::Connected) {
+            if (++connects == 2) {
+                con->setReconnectInterval(-1);
+            }
+            for (auto &m : sent) {
+                con->sendMsg(m);
+            }
+        }
+    });
+    for (int i = 0; i < 200 && got.size() < 2 * sent.size(); i++) {
+        base.loop_once(10);
+    }
+    ASSERT_EQ(2, connects);
+    ASSERT_EQ(2 * sent.size(), got.size());
+    for (size_t i = 0; i < got.size(); i++) {
+        ASSERT_EQ(sent[i % sent.size()], got[i]);
+    }
+}
+#endif
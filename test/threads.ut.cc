@@ -62,5 +62,81 @@ TEST(test::TestBase, SafeQueue) {
     usleep(300 * 1000);
     exit.store(true, memory_order_relaxed);
     t.join();
-    ASSERT_EQ(q.size(), 0);
+    ASSERT_EQ(0u, q.size());
+}
+
+TEST(test::TestBase, MpscQueue) {
+    MpscQueue<int> q(3);
+    ASSERT_EQ(true, q.push(1));
+    ASSERT_EQ(true, q.push(2));
+    ASSERT_EQ(true, q.push(3));
+    ASSERT_EQ(false, q.push(4));
+    ASSERT_EQ(3u, q.size());
+    int v = 0;
+    ASSERT_EQ(true, q.pop(&v));
+    ASSERT_EQ(1, v);
+
+    MpscQueue<int> q2;
+    vector<thread> ths;
+    for (int i = 0; i < 4; i++) {
+        ths.push_back(thread([&q2] {
+            for (int j = 1; j <= 10000; j++) {
+                q2.push(int(j));
+            }
+        }));
+    }
+    long sum = 0, popped = 0;
+    while (popped < 40000) {
+        if (q2.pop(&v)) {
+            sum += v;
+            popped++;
+        }
+    }
+    for (auto &t : ths) {
+        t.join();
+    }
+    ASSERT_EQ(4L * 10000 * 10001 / 2, sum);
+    ASSERT_EQ(false, q2.pop(&v));
+}
+
+TEST(test::TestBase, MpscQueuePopAll) {
+    MpscQueue<int> q;
+    ASSERT_EQ(0u, q.popAll([](int &&) {}));
+    for (int i = 1; i <= 5; i++) {
+        q.push(int(i));
+    }
+    vector<int> got;
+    // elements pushed from the callback are left for the next call
+    ASSERT_EQ(5u, q.popAll([&](int &&v) {
+        got.push_back(v);
+        q.push(v + 10);
+    }));
+    ASSERT_EQ(5u, got.size());
+    ASSERT_EQ(5u, q.size());
+    got.clear();
+    ASSERT_EQ(5u, q.popAll([&](int &&v) { got.push_back(v); }));
+    ASSERT_EQ(11, got[0]);
+    ASSERT_EQ(15, got[4]);
+    ASSERT_EQ(0u, q.size());
+
+    // producers alternate between two queues, each queue gets its own nodes back
+    MpscQueue<int> q1, q2;
+    vector<thread> ths;
+    for (int i = 0; i < 4; i++) {
+        ths.push_back(thread([&q1, &q2] {
+            for (int j = 1; j <= 10000; j++) {
+                (j % 2 ? q1 : q2).push(int(j));
+            }
+        }));
+    }
+    long sum = 0, popped = 0;
+    while (popped < 40000) {
+        popped += q1.popAll([&](int &&v) { sum += v; });
+        popped += q2.popAll([&](int &&v) { sum += v; });
+    }
+    for (auto &t : ths) {
+        t.join();
+    }
+    ASSERT_EQ(4L * 10000 * 10001 / 2, sum);
+    ASSERT_EQ(0u, q1.size() + q2.size());
 }